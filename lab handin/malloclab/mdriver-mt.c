@@ -0,0 +1,429 @@
+/*
+ * mdriver-mt.c - Multi-threaded driver for mm.c.
+ *
+ * Replay mode (-f): the operations of an mdriver trace are split across
+ * threads by block id, so each thread replays, in trace order, the
+ * requests of every t-th block. The trace is run with 1, 2, ... up to -t
+ * threads, -r times each on a fresh heap, and the total throughput of
+ * each run is printed next to its speedup over one thread: allocation
+ * scales with the cores only as far as those figures rise. With -c every
+ * payload is filled and checked as in mdriver, which slows the run.
+ *
+ * Stress mode (no -f): each thread runs a random mix of malloc, realloc
+ * and free over slots of its own, and now and then swaps one of its
+ * blocks with a shared slot, so blocks are reallocated and freed by other
+ * threads than the ones that allocated them. Every block carries its size
+ * and a fill pattern, which are checked before it is freed or reallocated
+ * and after a realloc.
+ *
+ * Threads are pinned to the CPUs round-robin; in stress mode they are
+ * also moved to another CPU every few thousand operations. After each run
+ * mm_checkheap is called, and anything it prints counts as an error, as
+ * do corrupt payloads and failed requests. The exit status is non-zero if
+ * there were any.
+ *
+ * Build with the lab's memlib.c, whose MAX_HEAP must hold the live data
+ * of all threads:
+ *     gcc -Wall -O2 -DDRIVER -o mdriver-mt mdriver-mt.c mm.c memlib.c -lpthread
+ *
+ * usage: mdriver-mt -f <tracefile> [-t max threads] [-r repeats] [-c]
+ *        mdriver-mt [-t threads] [-n ops per thread] [-l live blocks per thread] [-s seed]
+ */
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS 64
+#define SHARED      64      /* Slots through which threads pass blocks. */
+#define MIGRATE     4096    /* A thread moves to another CPU about this often (operations). */
+
+/* One block: its first word is its size, the rest is filled from it. */
+typedef struct {
+    size_t size;
+    unsigned char data[];
+} block_t;
+
+/* One request of a trace */
+typedef struct {
+    char type;              /* 'a'lloc, 'r'ealloc or 'f'ree */
+    int id;                 /* Block the request is for */
+    size_t size;            /* Bytes asked for by 'a' and 'r' */
+} op_t;
+
+/* A trace in mdriver's format */
+typedef struct {
+    int nids;               /* Number of distinct block ids */
+    int nops;               /* Number of requests */
+    op_t *ops;
+} trace_t;
+
+static int nthreads = 4, nops = 1000000, nlive = 256, repeats = 10, checking;
+static unsigned seed = 1;
+static int ncpus;
+static block_t *shared[SHARED];
+static trace_t *trace;
+static int errors;
+
+/* error - print what went wrong and count it */
+static void __attribute__((format(printf, 1, 2))) error(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+/* rnd - next value of a thread's xorshift generator */
+static unsigned rnd(unsigned *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+/* pick_size - a request size: mostly small, some medium, a few large */
+static size_t pick_size(unsigned *s)
+{
+    unsigned r = rnd(s) % 100;
+
+    if (r < 60)
+        return sizeof(block_t) + rnd(s) % 256;
+    if (r < 95)
+        return sizeof(block_t) + rnd(s) % 4096;
+    return sizeof(block_t) + rnd(s) % 65536;
+}
+
+/* fill - stamp b with its size and the pattern that goes with it */
+static void fill(block_t *b, size_t size)
+{
+    b->size = size;
+    memset(b->data, (unsigned char)(size * 31), size - sizeof(block_t));
+}
+
+/* check - report a block whose size or first n pattern bytes are wrong */
+static void check(block_t *b, size_t size, size_t n, const char *when)
+{
+    size_t i;
+
+    if (b->size != size) {
+        error("%s: block %p has size %zu, not %zu\n", when, (void *)b, b->size, size);
+        return;
+    }
+    for (i = 0; i < n - sizeof(block_t); i++) {
+        if (b->data[i] != (unsigned char)(size * 31)) {
+            error("%s: block %p of size %zu is corrupt at byte %zu\n",
+                  when, (void *)b, size, sizeof(block_t) + i);
+            return;
+        }
+    }
+}
+
+/* alloc - malloc a filled block of the given size */
+static block_t *alloc(size_t size)
+{
+    block_t *b = mm_malloc(size);
+
+    if (!b) {
+        error("mm_malloc(%zu) failed\n", size);
+        return NULL;
+    }
+    fill(b, size);
+    return b;
+}
+
+/* pin - move the calling thread to the given CPU */
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* checkheap - run mm_checkheap, counting an error if it prints anything */
+static void checkheap(void)
+{
+    FILE *out = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    char buf[4096];
+    size_t n, total = 0;
+
+    fflush(stdout);
+    dup2(fileno(out), STDOUT_FILENO);
+    mm_checkheap(0);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    rewind(out);
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) {
+        fwrite(buf, 1, n, stdout);
+        total += n;
+    }
+    fclose(out);
+    if (total)
+        error("mm_checkheap found the heap inconsistent\n");
+}
+
+/* load - read a trace in mdriver's format */
+static trace_t *load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    trace_t *t;
+    int heap, weight, i;
+    op_t *o;
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    t = calloc(1, sizeof(trace_t));
+    if (fscanf(f, "%d %d %d %d", &heap, &t->nids, &t->nops, &weight) != 4 ||
+        t->nids <= 0 || t->nops <= 0) {
+        fprintf(stderr, "%s: bad trace header\n", path);
+        exit(1);
+    }
+    t->ops = calloc(t->nops, sizeof(op_t));
+    for (i = 0; i < t->nops; i++) {
+        o = &t->ops[i];
+        if (fscanf(f, " %c %d", &o->type, &o->id) != 2 || o->id < 0 || o->id >= t->nids ||
+            (o->type != 'a' && o->type != 'r' && o->type != 'f') ||
+            (o->type != 'f' && fscanf(f, "%zu", &o->size) != 1)) {
+            fprintf(stderr, "%s: bad request %d\n", path, i);
+            exit(1);
+        }
+    }
+    fclose(f);
+    return t;
+}
+
+/* pattern - the byte at offset i of block id's payload */
+static unsigned char pattern(int id, size_t i)
+{
+    return (unsigned char)(id * 131 + i * 7 + 1);
+}
+
+/* verify - report a payload whose first n bytes do not hold its pattern */
+static void verify(char *p, int id, size_t n, int op)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if ((unsigned char)p[i] != pattern(id, i)) {
+            error("request %d: payload of block %d is corrupt at byte %zu\n", op, id, i);
+            return;
+        }
+    }
+}
+
+/* replay - one thread's share of the trace: the blocks whose id % nthreads is its number */
+static void *replay(void *arg)
+{
+    long self = (long)arg;
+    char **ptr = calloc(trace->nids, sizeof(char *));
+    size_t *size = calloc(trace->nids, sizeof(size_t)), i;
+    op_t *o;
+    char *p;
+    int r, k;
+
+    pin(self);
+    for (r = 0; r < repeats; r++) {
+        for (k = 0; k < trace->nops; k++) {
+            o = &trace->ops[k];
+            if (o->id % nthreads != self)
+                continue;
+            switch (o->type) {
+            case 'a':
+                if (!(p = mm_malloc(o->size))) {
+                    error("request %d: mm_malloc(%zu) failed\n", k, o->size);
+                    break;
+                }
+                if (checking)
+                    for (i = 0; i < o->size; i++)
+                        p[i] = pattern(o->id, i);
+                ptr[o->id] = p;
+                size[o->id] = o->size;
+                break;
+            case 'r':
+                if (checking && ptr[o->id])
+                    verify(ptr[o->id], o->id, size[o->id], k);
+                if (!(p = mm_realloc(ptr[o->id], o->size)) && o->size) {
+                    error("request %d: mm_realloc(%zu) failed\n", k, o->size);
+                    break;
+                }
+                if (checking) {
+                    verify(p, o->id, size[o->id] < o->size ? size[o->id] : o->size, k);
+                    for (i = 0; i < o->size; i++)
+                        p[i] = pattern(o->id, i);
+                }
+                ptr[o->id] = p;
+                size[o->id] = o->size;
+                break;
+            case 'f':
+                if (checking && ptr[o->id])
+                    verify(ptr[o->id], o->id, size[o->id], k);
+                mm_free(ptr[o->id]);
+                ptr[o->id] = NULL;
+                break;
+            }
+        }
+        /* Blocks the trace leaves allocated go before the next round */
+        for (k = self; k < trace->nids; k += nthreads) {
+            mm_free(ptr[k]);
+            ptr[k] = NULL;
+        }
+    }
+    free(ptr);
+    free(size);
+    return NULL;
+}
+
+/* worker - one thread's share of a stress run */
+static void *worker(void *arg)
+{
+    long id = (long)arg;
+    unsigned s = seed * 2654435761u + id * 40503 + 1;
+    block_t **live = calloc(nlive, sizeof(block_t *));
+    block_t *b;
+    size_t size, old;
+    int i, k;
+
+    pin(id);
+    for (i = 0; i < nops; i++) {
+        k = rnd(&s) % nlive;
+        switch (rnd(&s) % 8) {
+        case 0: /* realloc, keeping the shorter of the two patterns */
+            if (!live[k])
+                break;
+            size = pick_size(&s);
+            old = live[k]->size;
+            check(live[k], old, old, "before realloc");
+            if (!(b = mm_realloc(live[k], size))) {
+                error("mm_realloc(%p, %zu) failed\n", (void *)live[k], size);
+                live[k] = NULL;
+                break;
+            }
+            check(b, old, old < size ? old : size, "after realloc");
+            fill(b, size);
+            live[k] = b;
+            break;
+        case 1: /* swap with a shared slot: the block may be freed by another thread */
+            live[k] = __atomic_exchange_n(&shared[rnd(&s) % SHARED], live[k], __ATOMIC_ACQ_REL);
+            break;
+        default:
+            if (live[k]) {
+                check(live[k], live[k]->size, live[k]->size, "before free");
+                mm_free(live[k]);
+                live[k] = NULL;
+            } else {
+                live[k] = alloc(pick_size(&s));
+            }
+        }
+        if (rnd(&s) % MIGRATE == 0)
+            pin(rnd(&s));
+    }
+    for (k = 0; k < nlive; k++) {
+        if (live[k]) {
+            check(live[k], live[k]->size, live[k]->size, "at exit");
+            mm_free(live[k]);
+        }
+    }
+    free(live);
+    return NULL;
+}
+
+/* run - start n threads at fn on a fresh heap and wait for them; returns the seconds taken */
+static double run(void *(*fn)(void *), int n)
+{
+    pthread_t tid[MAX_THREADS];
+    struct timespec start, end;
+    long i;
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        printf("mm_init failed\n");
+        exit(1);
+    }
+    nthreads = n;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++)
+        pthread_create(&tid[i], NULL, fn, (void *)i);
+    for (i = 0; i < n; i++)
+        pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s -f <tracefile> [-t max threads] [-r repeats] [-c]\n"
+            "       %s [-t threads] [-n ops per thread] [-l live blocks per thread] [-s seed]\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *tracefile = NULL;
+    double secs, base = 0;
+    int c, n, max;
+    long i;
+
+    while ((c = getopt(argc, argv, "f:t:r:cn:l:s:")) != -1) {
+        switch (c) {
+        case 'f': tracefile = optarg; break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'r': repeats = atoi(optarg); break;
+        case 'c': checking = 1; break;
+        case 'n': nops = atoi(optarg); break;
+        case 'l': nlive = atoi(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || nthreads <= 0 || nthreads > MAX_THREADS || repeats <= 0 ||
+        nops < 0 || nlive <= 0)
+        usage(argv[0]);
+    if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpus = 1;
+    mem_init();
+
+    if (tracefile) {
+        trace = load(tracefile);
+        printf("%s: %d requests x %d, %d CPUs\n", tracefile, trace->nops, repeats, ncpus);
+        for (max = nthreads, n = 1; n <= max; n++) {
+            secs = run(replay, n);
+            checkheap();
+            if (n == 1)
+                base = secs;
+            printf("%2d threads: %8.0f Kops/s  speedup %.2f\n",
+                   n, (double)trace->nops * repeats / secs / 1e3, base / secs);
+        }
+    } else {
+        secs = run(worker, nthreads);
+        for (i = 0; i < SHARED; i++) {
+            if (shared[i]) {
+                check(shared[i], shared[i]->size, shared[i]->size, "at exit");
+                mm_free(shared[i]);
+                shared[i] = NULL;
+            }
+        }
+        checkheap();
+        printf("%d threads on %d CPUs: %.0f Kops/s\n",
+               nthreads, ncpus, (double)nthreads * nops / secs / 1e3);
+    }
+    printf("%d errors\n", errors);
+    return errors ? 1 : 0;
+}
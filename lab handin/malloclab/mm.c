@@ -9,23 +9,70 @@
  * Key Features:
  * 1. Segregated Free Lists: Organizes free blocks into multiple free lists 
  *    based on block sizes for efficient allocation and reduced fragmentation.
- * 2. First-Fit Search: Searches for the first sufficiently large block in 
- *    the appropriate free list.
+ *    Size classes are two-level: each power of two is split into SL_COUNT
+ *    equal ranges. A first-level bitmap marks the powers of two with a
+ *    non-empty class and a second-level bitmap per power of two marks those
+ *    classes, so the next non-empty class is found with one or two ctz.
+ * 2. Bounded Fit Search: Freed blocks are pushed on the front of their
+ *    bucket. A search looks at no more than FIT_LOOKAHEAD blocks of the
+ *    request's own class, where a block may be too small, and otherwise of
+ *    the next non-empty class, where every block fits. mm_init picks how
+ *    a block is chosen among those: the first that fits, the smallest, or
+ *    the lowest in memory (MM_FIT=first, best or address).
  * 3. Boundary Tag Coalescing: Merges adjacent free blocks to prevent 
  *    fragmentation and maintain larger contiguous free spaces.
+ * 4. Thread Caches: Each arena is guarded by one mutex. In front of the
+ *    arenas each thread keeps a few free objects of every slab class; most
+ *    small mallocs and frees only touch that cache, and an arena lock is
+ *    taken once per batch of objects moved between the two.
+ * 5. Arenas: The heap is split into up to ARENA_MAX arenas, each with its
+ *    own free lists, lock, and segments of blocks between a prologue and
+ *    an epilogue. While one thread has used the heap, all of it is the
+ *    first arena's; from the second on, a thread allocates from the arena
+ *    of the CPU it runs on.
+ *    A block freed by a thread of another arena is pushed on the owner's
+ *    lock-free remote-free stack, and the owner takes it back the next
+ *    time it allocates. Arenas after the first lay out their segments in
+ *    64KB units; an owner map with a byte per unit tells a block's arena.
+ * 6. Slabs: Requests up to SLAB_MAX bytes are objects of a size class,
+ *    packed without headers into page-sized slabs. A slab is an ordinary
+ *    allocated block, page aligned, that starts with its object size and a
+ *    bitmap of free objects. A bitmap with a bit per page of the heap tells
+ *    free() whether a pointer is a slab object.
+ * 7. Mapped Blocks: Requests of at least mmap_threshold bytes get a mapping
+ *    of their own, returned to the system when freed, so one huge block
+ *    cannot fragment the heap for good. As in glibc, freeing a mapped block
+ *    larger than the threshold raises it to that size, up to MMAP_MAX, so
+ *    a program that keeps reallocating such blocks is served by the heap.
+ *    Mappings of HUGE_MIN bytes or more ask for transparent huge pages.
+ *    The driver checks that every payload lies in its heap, so it is built
+ *    without mapped blocks.
+ * 8. Page Release: mem_sbrk cannot shrink the heap, so memory goes back
+ *    to the system with madvise instead. Every trim_threshold bytes freed
+ *    into an arena, the whole pages inside its free blocks of RELEASE_MIN
+ *    bytes or more, the top block included, are released; a RELEASED bit
+ *    in the header keeps a block from being released twice. Resident
+ *    memory then follows live data, not the heap's high-water mark.
  *
  * The allocator uses a header at the beginning of each block to store the 
  * block's size and allocation status. Footers may also be used for free blocks 
- * to aid in coalescing. The heap structure includes prologue and epilogue 
+ * to aid in coalescing. Free blocks are doubly linked: the successor and
+ * predecessor links are 32-bit offsets from the start of the heap, so both
+ * fit in a 16-byte minimum block and a block is unlinked in constant time.
+ * The heap structure includes prologue and epilogue 
  * blocks that simplify boundary conditions during coalescing and allocation.
  *
  *
  */
+#define _GNU_SOURCE /* sched_getcpu */
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -48,11 +95,56 @@
 #define calloc mm_calloc
 #endif /* def DRIVER */
 
+/* Large blocks get mappings of their own and free pages are released, but
+ * payloads outside mem_sbrk's heap fail the driver's checks, and the driver
+ * counts the heap's extent, not the pages it keeps. */
+#ifndef DRIVER
+#define USE_MMAP
+#define USE_RELEASE
+#endif
+
 // Constants for dynamic memory allocation
 #define WSIZE       4       /* Size of word, header, and footer (bytes). */
 #define DSIZE       8       /* Size of double word (bytes), used for alignment. */
-#define minsize     16      /* Minimum block size including overhead (bytes). */
-#define free_list_size 9    /* Number of buckets in the free list for block segregation. */
+#define minsize     16      /* Minimum block size: header, two links and footer (bytes). */
+#define SL_BITS     2       /* log2 of the number of classes each power of two is split into. */
+#define SL_COUNT    (1 << SL_BITS) /* Second-level classes per power of two. */
+#define FL_MIN      4       /* log2 of minsize: the first power of two with classes. */
+#define FL_COUNT    28      /* Powers of two from minsize up to the largest 32-bit block size. */
+#define free_list_size (FL_COUNT * SL_COUNT) /* Number of buckets in the free list for block segregation. */
+#define LISTS_SIZE  (free_list_size * WSIZE + WSIZE + FL_COUNT) /* Bucket entries, then the bitmaps. */
+#define SLAB_SIZE   4096    /* Slabs are one page (bytes). */
+#define SLAB_MAX    256     /* Largest request served from slabs (bytes). */
+#define SLAB_SMALL  64      /* Slab classes are DSIZE apart up to here, then SL_COUNT per power of two. */
+#define SLAB_CLASSES (SLAB_SMALL / DSIZE + 2 * SL_COUNT) /* Classes up to SLAB_MAX, two powers of two above SLAB_SMALL. */
+#define SLAB_HEAD   (2 * DSIZE + SLAB_SIZE / DSIZE / 8) /* Links, object size, free count, then the free bitmap. */
+#define SLAB_CAP(size) ((SLAB_SIZE - WSIZE - SLAB_HEAD) / (size)) /* Objects of a size in a slab. */
+#define LEAF_SHIFT  26      /* log2 of the heap span a slab map leaf covers. */
+#define LEAF_SIZE   (1 << (LEAF_SHIFT - 12 - 3)) /* Bytes in a leaf: a bit per page. */
+#define ROOT_SIZE   ((1 << (32 - LEAF_SHIFT)) * WSIZE) /* Bytes in the root: a leaf offset per span. */
+#define ARENA_FIELDS (LISTS_SIZE + ALIGN(sizeof(pthread_mutex_t))) /* An arena's fields come after its lists and lock. */
+#define ARENA_SIZE  (ARENA_FIELDS + 3 * DSIZE + SLAB_CLASSES * WSIZE) /* The lists, the lock, the fields, then the slab lists. */
+#define ARENA_MAX   8       /* Arenas; threads are spread over them by CPU. */
+#define MAP_SHIFT   16      /* log2 of the unit segments of arenas after the first are laid out in. */
+#define MAP_UNIT    (1 << MAP_SHIFT) /* Owner map granularity (bytes). */
+#define MAP_SIZE    (1 << (32 - MAP_SHIFT)) /* Owner map size: a byte per unit of 32-bit heap offsets. */
+#define PRELUDE_SIZE (ARENA_SIZE + ALIGN(sizeof(pthread_mutex_t)) + ALIGN((ARENA_MAX + 2) * WSIZE)) /* The first arena, the break lock, the arena table and the maps. */
+#define TCACHE_BINS SLAB_CLASSES /* One bin per slab class. */
+#define TCACHE_COUNT 16     /* Blocks a bin holds before the older half goes back to the heap. */
+#define TCACHE_SIZE ALIGN(TCACHE_BINS * DSIZE + WSIZE) /* Block size of a thread cache. */
+#define REQUEST_MAX ((1UL << (FL_MIN + FL_COUNT)) - minsize) /* Largest request a block header can hold (bytes). */
+#define MMAP_MIN    (128 * 1024) /* Initial mmap_threshold (bytes). */
+#define MMAP_MAX    (32 * 1024 * 1024) /* mmap_threshold never rises above this (bytes). */
+#define OS_PAGE     4096    /* System page: mappings and released runs are whole pages (bytes). */
+#define MMAP_HEAD   (3 * DSIZE) /* Links and length before a mapped block's payload. */
+#define HUGE_MIN    (4 * 1024 * 1024) /* Mappings from this size on ask for huge pages (bytes). */
+#define RELEASE_MIN (64 * 1024) /* Free blocks from this size on have their pages released (bytes). */
+#define TRIM_THRESHOLD (256 * 1024) /* Initial trim_threshold (bytes). */
+#define FIT_FIRST   0       /* Placement policy: the first block that fits. */
+#define FIT_BEST    1       /* Placement policy: the smallest block that fits. */
+#define FIT_ADDRESS 2       /* Placement policy: the lowest block that fits. */
+#define FIT_DEFAULT FIT_BEST /* Placement policy unless MM_FIT names another. */
+#define FIT_LOOKAHEAD 8     /* Blocks of a bucket a search looks at. */
 #define CHUNKSIZE   3072  /* Size to extend heap by (bytes), balancing space and overhead. */
 
 //macro first function
@@ -67,9 +159,50 @@
 #define RESET_ALLOC(p)      ((*(unsigned*)(p)) = (*(unsigned*)(p))&~0x1)/* Marks the block at address p as free. */
 #define SET_PALLOC(p)       ((*(unsigned*)(p)) =(*(unsigned*)(p)) |0x2)/* Marks the previous block relative to p as allocated. */
 #define RESET_PALLOC(p)     ((*(unsigned*)(p)) = (*(unsigned*)(p))&~0x2)/* Marks the previous block relative to p as free. */
+#define RELEASED            0x4 /* Free block bit: the pages inside the block have been released. */
+#define RESET_RELEASED(p)   ((*(unsigned*)(p)) = (*(unsigned*)(p))&~RELEASED)/* Marks the block at address p as holding pages. */
 #define ALIGN(p) (((size_t)(p) + 7) & ~0x7) /* Aligns p to the nearest alignment boundary. */
-#define succeed(bp) ((void*)(*(size_t*)(bp)))         /* Gets successor block pointer. */
-#define put_suc(bp, succp)     (*(size_t*)(bp) = (size_t)(succp))  /* Sets successor block pointer. */
+#define OFFSET(p)    ((p) ? (unsigned)((char *)(p) - explicit_free_list) : 0) /* Heap offset of p, 0 for NULL. */
+#define ADDRESS(off) ((off) ? (void *)(explicit_free_list + (off)) : NULL)    /* Pointer for a heap offset. */
+#define succeed(bp) ADDRESS(GET(bp))         /* Gets successor block pointer. */
+#define put_suc(bp, succp)     PUT(bp, OFFSET(succp))  /* Sets successor block pointer. */
+#define precede(bp) ADDRESS(GET((char *)(bp) + WSIZE))         /* Gets predecessor block pointer, NULL for the first. */
+#define put_pre(bp, prep)     PUT((char *)(bp) + WSIZE, OFFSET(prep))  /* Sets predecessor block pointer. */
+#define free_list_end (arena + free_list_size * WSIZE) /* End of the current arena's buckets, where its bitmaps start. */
+#define fl_bitmap    (*(unsigned *)free_list_end) /* Bit f set: some class of the f-th power of two is non-empty. */
+#define sl_bitmap(f) (((unsigned char *)free_list_end)[WSIZE + (f)]) /* Bit s set: class s of the f-th is non-empty. */
+#define arena_lock(a) ((pthread_mutex_t *)((a) + LISTS_SIZE)) /* Guards every block and list of arena a. */
+#define LOCK(a)      (pthread_mutex_lock(arena_lock(a)), arena = (a)) /* Takes arena a's lock; a becomes the current arena. */
+#define UNLOCK()     pthread_mutex_unlock(arena_lock(arena))          /* Releases the current arena's lock. */
+#define epilogue     (*(char **)(arena + ARENA_FIELDS)) /* Epilogue of the current arena's newest segment. */
+#define segments     (*(unsigned *)(arena + ARENA_FIELDS + DSIZE)) /* Newest segment of the current arena; each links to the one before. */
+#define remote_head(a) (*(unsigned *)((a) + ARENA_FIELDS + DSIZE + WSIZE)) /* Blocks freed into arena a by other threads. */
+#define arena_id(a)  (*(unsigned *)((a) + ARENA_FIELDS + 2 * DSIZE)) /* Index of arena a in the arena table. */
+#define freed_bytes  (*(unsigned *)(arena + ARENA_FIELDS + 2 * DSIZE + WSIZE)) /* Bytes freed into the current arena since its pages were last released. */
+#define slab_list(c) (((unsigned *)(arena + ARENA_FIELDS + 3 * DSIZE))[c]) /* Current arena's slabs of class c with free objects. */
+#define sbrk_lock    ((pthread_mutex_t *)(explicit_free_list + ARENA_SIZE)) /* Serializes mem_sbrk between arenas, and guards the mapped blocks. */
+#define arena_table(i) (((unsigned *)(explicit_free_list + ARENA_SIZE + ALIGN(sizeof(pthread_mutex_t))))[i]) /* Arena i as an offset, 0 until made. */
+#define owner_map    arena_table(ARENA_MAX) /* Owner map as an offset, 0 while there is only the first arena. */
+#define slab_map     arena_table(ARENA_MAX + 1) /* Slab map root as an offset, 0 until the first slab. */
+#define SLAB_OF(p)   (explicit_free_list + (OFFSET(p) & ~(SLAB_SIZE - 1))) /* The slab holding object p. */
+#define slab_next(s) (*(unsigned *)(s))                         /* Next slab of the class list. */
+#define slab_prev(s) (*(unsigned *)((char *)(s) + WSIZE))       /* Previous slab of the class list, 0 for the first. */
+#define slab_size(s) (*(unsigned short *)((char *)(s) + DSIZE)) /* Object size of slab s. */
+#define slab_nfree(s) (*(unsigned short *)((char *)(s) + DSIZE + 2)) /* Free objects in slab s. */
+#define slab_bits(s) ((unsigned long long *)((char *)(s) + 2 * DSIZE)) /* Bit i set: object i of slab s is free. */
+#define slab_index(p) (((char *)(p) - SLAB_OF(p) - SLAB_HEAD) / slab_size(SLAB_OF(p))) /* Index of object p in its slab. */
+#define slab_fits(bp) (slab_align(bp) + SLAB_SIZE <= (char *)(bp) + GET_SIZE(bp)) /* Checks if a slab fits in free block bp. */
+#define slab_taken(p) (!((slab_bits(SLAB_OF(p))[slab_index(p) / 64] >> (slab_index(p) % 64)) & 1)) /* Checks if object p is allocated. */
+#define PAGE_UP(n)   (((size_t)(n) + OS_PAGE - 1) & ~(size_t)(OS_PAGE - 1)) /* Rounds n up to a whole page. */
+#define MMAP_OF(p)   ((char *)(p) - MMAP_HEAD)   /* The mapping holding mapped block p. */
+#define mmap_next(m) (*(char **)(m))             /* Next mapping of the list. */
+#define mmap_prev(m) (*(char **)((m) + DSIZE))   /* Previous mapping of the list, NULL for the first. */
+#define mmap_len(m)  (*(size_t *)((m) + 2 * DSIZE)) /* Length of mapping m (bytes). */
+#define is_mapped(p) ((char *)(p) < explicit_free_list || (char *)(p) >= __atomic_load_n(&heap_end, __ATOMIC_RELAXED)) /* Checks if p is outside the heap, in a mapping. */
+#define UNIT_ALIGN(off) (((off) + MAP_UNIT - 1) & ~(size_t)(MAP_UNIT - 1)) /* Rounds a heap offset up to an owner map unit. */
+#define tc_head(b)   (*(unsigned *)(tcache + (b) * DSIZE))                /* First cached block of bin b, as an offset. */
+#define tc_count(b)  (*(unsigned short *)(tcache + (b) * DSIZE + WSIZE))  /* Blocks cached in bin b. */
+#define tc_fill(b)   (*(unsigned short *)(tcache + (b) * DSIZE + WSIZE + 2)) /* Blocks bin b takes per refill. */
 
 //macro second function
 #define GET_SIZE(bp)  (GET(HDRP(bp)) & ~0x7)             /* Retrieves the size of the block from its header. */
@@ -83,18 +216,58 @@
    
 /* Global variables */
 static char *heap_listp; /* Pointer to the start of the heap. */
-static char *epilogue; /* Pointer to the epilogue header of the heap. */
-static char *explicit_free_list; /* Pointer to the start of the explicit free list. */
-static char *free_list_end; /* Pointer to the end of the explicit free list. */
+static char *explicit_free_list; /* Pointer to the start of the heap prelude, and of the first arena's free lists. */
+static __thread char *arena; /* The arena whose lock this thread holds: the free lists in use. */
+static unsigned heap_gen; /* Bumped by mm_init, so caches of an earlier heap are dropped. */
+static pthread_key_t tcache_key; /* Flushes a thread's cache when it exits. */
+static int tcache_key_made; /* Set once tcache_key exists. */
+static __thread char *tcache; /* This thread's cache: a heap block holding TCACHE_BINS bins. */
+static __thread unsigned tcache_gen; /* heap_gen when tcache was made. */
+static char *heap_end; /* End of the heap; any payload past it is a mapped block. */
+static char *mapped; /* Mapped blocks, linked through their mappings; guarded by sbrk_lock. */
+static size_t mapped_bytes; /* Total length of the mappings; guarded by sbrk_lock. */
+static size_t mmap_threshold; /* Requests of this size and above are mapped (bytes). */
+static size_t trim_threshold; /* Bytes freed into an arena between two page releases. */
+static int fit_policy; /* How find_fit chooses among the blocks it looks at. */
+static pthread_t init_thread; /* The thread that called mm_init. */
+static int multi_thread; /* Set once another thread has used the heap; until then there is only the main arena. */
 
 //function
 static void* extend_heap(size_t words);/* Extends the heap with a new free block. */
 static void* place(void *bp, size_t asize);/* Allocates a block of asize bytes at bp and splits if necessary. */
 static void* find_fit(size_t asize);/* Finds a fit for a block with asize bytes. */
+static void* fit_bucket(void *bp, size_t asize);/* Chooses a fit among the first blocks of a bucket. */
 static void* coalesce(void *bp);/* Coalesces adjacent free blocks around bp. */
+static int get_class(size_t size);/* Returns the size class of blocks of size 'size'. */
 static void* get_index(size_t size);/* Returns the index for the free list for blocks of size 'size'. */
 static void* insert(void *bp);/* Inserts a block into the free list. */
 static void delete(void *bp);/* Removes a block from the free list. */
+static void* heap_alloc(size_t asize);/* Allocates a block of asize bytes from the heap; the heap lock is held. */
+static void heap_free(void *bp);/* Returns a block to the heap; the heap lock is held. */
+static int heap_resize(void *bp, size_t asize);/* Grows or shrinks a block in place; the heap lock is held. */
+static void heap_release(void);/* Gives the pages inside large free blocks back to the system; the heap lock is held. */
+static char* tcache_self(void);/* Returns this thread's cache, making it on first use. */
+static void* tcache_get(int cls);/* Takes an object of slab class cls from this thread's cache. */
+static int tcache_put(void *bp);/* Keeps a freed slab object in this thread's cache if it has room. */
+static void tcache_release(void *tc);/* Returns a thread's cached blocks to the heap when it exits. */
+static char* get_arena(int id);/* Returns arena id, making it on first use. */
+static char* pick_arena(void);/* Returns the arena this thread allocates from. */
+static char* get_owner(void *bp);/* Returns the arena a block belongs to. */
+static void free_chain(void *bp);/* Frees blocks linked through their payloads, each to its own arena. */
+static void remote_free(char *a, void *bp);/* Pushes a block on arena a's remote-free stack. */
+static void drain_remote(void);/* Frees the blocks on the current arena's remote-free stack. */
+static void arena_free(void *bp);/* Frees a slab object or a block into the current arena. */
+static int is_slab(void *p);/* Checks if p is in a slab page. */
+static int slab_mark(char *s, int on);/* Sets or clears the slab map bit of the page at s. */
+static int slab_class(size_t size);/* Returns the slab class of a request of size bytes. */
+static size_t class_size(int cls);/* Returns the object size of slab class cls. */
+static void* slab_new(int cls);/* Carves a page-aligned slab of class cls from the current arena. */
+static char* slab_align(char *bp);/* Returns where a slab would start in free block bp. */
+static void* slab_alloc(int cls);/* Takes an object of class cls from the current arena's slabs. */
+static void slab_free(void *p);/* Returns an object to its slab. */
+static void* mmap_alloc(size_t size);/* Maps a block of its own for a large request. */
+static void mmap_free(void *bp);/* Unmaps a mapped block. */
+static void* mmap_resize(void *bp, size_t size);/* Remaps a mapped block to a new size. */
 
 /*
  * mm_init - Initializes the memory manager. 
@@ -102,31 +275,52 @@ static void delete(void *bp);/* Removes a block from the free list. */
  * Returns -1 on error, 0 on success.
  */
 int mm_init(void) {
-    explicit_free_list = mem_sbrk(free_list_size * DSIZE + 2 * WSIZE);
-    // Create the initial empty heap with space for the free list and prologue/epilogue blocks
+    explicit_free_list = mem_sbrk(PRELUDE_SIZE);
+    // Create the heap prelude: the first arena's free lists and the tables shared by all arenas
     if ( explicit_free_list== ((void *)-1)) {
         return -1;  
     }
-    // Initialize the free list to zeroes
-    memset(explicit_free_list, 0, free_list_size * DSIZE);
-    // Set the end pointer for the free list
-    free_list_end = explicit_free_list + free_list_size * DSIZE;
-    heap_listp = explicit_free_list + free_list_size * DSIZE;
-    // Initialize heap list pointer, check for allocation failure
-    if (heap_listp== ((void *)-1)) {
-        return -1; 
-    }
-    // Initialize the prologue block
-    PUT(heap_listp, PACK(DSIZE, 1, 1)); // Prologue header
-    PUT(heap_listp + WSIZE, PACK(0, 1, 1)); // Epilogue header
-    // Move heap_listp to point to the first block in the heap
-    heap_listp += (2 * WSIZE);
-    // Set the epilogue pointer
-    epilogue = heap_listp;
-    // Extend the heap with a free block of default size
-    if (extend_heap(1 << 14) == NULL) {
+    // Initialize the free lists, their bitmaps and the arena table to zeroes
+    memset(explicit_free_list, 0, PRELUDE_SIZE);
+    // The first arena is the current one while the heap is built
+    arena = explicit_free_list;
+    // Set up the locks; thread caches of a previous heap are now stale
+    pthread_mutex_init(arena_lock(arena), NULL);
+    pthread_mutex_init(sbrk_lock, NULL);
+    heap_gen++;
+    init_thread = pthread_self();
+    multi_thread = 0;
+    // Mapped blocks of a previous heap go with it
+    while (mapped) {
+        char *m = mapped;
+        mapped = mmap_next(m);
+        munmap(m, mmap_len(m));
+    }
+    mapped_bytes = 0;
+#ifdef USE_MMAP
+    mmap_threshold = MMAP_MIN;
+#else
+    mmap_threshold = ~(size_t)0;
+#endif
+    // Pick the placement policy
+    const char *fit = getenv("MM_FIT");
+    fit_policy = !fit ? FIT_DEFAULT : !strcmp(fit, "first") ? FIT_FIRST
+                 : !strcmp(fit, "address") ? FIT_ADDRESS : FIT_BEST;
+#ifdef USE_RELEASE
+    trim_threshold = TRIM_THRESHOLD;
+#else
+    trim_threshold = ~(size_t)0;
+#endif
+    if (!tcache_key_made) {
+        pthread_key_create(&tcache_key, tcache_release);
+        tcache_key_made = 1;
+    }
+    // Extend the heap with a first segment holding a free block of default size
+    if (extend_heap(1 << 14) == (void *)-1) {
         return -1;  
     }
+    // Set heap_listp to the first block in the heap
+    heap_listp = (char *)ADDRESS(segments) + 2 * DSIZE;
     dbg_checkheap(__LINE__);
     // Initialization successful
     return 0;
@@ -138,17 +332,47 @@ int mm_init(void) {
  */
 void *malloc(size_t size) {
     dbg_checkheap(__LINE__);
-    // Return NULL immediately for a request of zero bytes
-    if (size == 0) {
+    // Return NULL immediately for a request of zero bytes, or one too large for a header
+    if (size == 0 || size > REQUEST_MAX) {
         return NULL;
     }
     dbg_checkheap(__LINE__);
-    if (size == 448) {
-        size = 512;    // Magic alignment adjustment
+    void *bp;
+    // Small requests are slab objects, from this thread's cache if it has one
+    if (size <= SLAB_MAX) {
+        int cls = slab_class(size);
+        if (!(bp = tcache_get(cls))) {
+            LOCK(pick_arena());
+            bp = slab_alloc(cls);
+            UNLOCK();
+        }
+        return bp;
+    }
+    // Large requests get a mapping of their own, or the heap if mmap fails
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) && (bp = mmap_alloc(size))) {
+        return bp;
     }
     // Align the block size and ensure it's not smaller than the minimum block size
     size = size + WSIZE <= minsize ? minsize : ALIGN(size + WSIZE);
     dbg_checkheap(__LINE__);
+    // The rest are blocks from this thread's arena
+    LOCK(pick_arena());
+    bp = heap_alloc(size);
+    UNLOCK();
+    return bp;
+}
+
+/*
+ * heap_alloc - Allocates a block of asize bytes, header included, from the
+ * current arena, extending it if no free block fits. The caller holds the
+ * arena's lock.
+ * Returns NULL if the heap cannot grow.
+ */
+static void *heap_alloc(size_t size) {
+    // First take back the blocks other threads freed into this arena
+    if (__atomic_load_n(&remote_head(arena), __ATOMIC_RELAXED)) {
+        drain_remote();
+    }
     // Find a fit for the requested block size
     void *bp = find_fit(size);
     dbg_checkheap(__LINE__);
@@ -175,17 +399,117 @@ void free(void *ptr) {
     if (ptr == 0) {
         return;
     }
+    // Mapped blocks go straight back to the system
+    if (is_mapped(ptr)) {
+        mmap_free(ptr);
+        return;
+    }
+    // Keep slab objects in this thread's cache while it has room
+    if (is_slab(ptr) && tcache_put(ptr)) {
+        return;
+    }
+    // Otherwise return it to its arena, as a chain of one
+    PUT(ptr, 0);
+    free_chain(ptr);
+}
+
+/*
+ * heap_free - Marks a block free and merges it into the current arena's
+ * free lists. The caller holds the arena's lock.
+ */
+static void heap_free(void *ptr) {
     RESET_ALLOC(HDRP(ptr)); // Resets the allocated bit in the block's header
     PUT(FTRP(ptr), GET(HDRP(ptr))); // Updates the block's footer to match its header
     // Find the next block and reset its previous-allocated status
     void *n = find_next_blankblock(ptr); 
     RESET_PALLOC(HDRP(n)); // Resets the previous-allocated bit of the next block's header
+    size_t size = GET_SIZE(ptr);
     coalesce(ptr); // Merges the current block with adjacent free blocks
+    // Release pages once enough has been freed since the last time
+    if ((freed_bytes += size) >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)) {
+        heap_release();
+    }
+}
+
+/*
+ * heap_release - Gives the whole pages inside the current arena's free
+ * blocks of RELEASE_MIN bytes or more back to the system. mem_sbrk cannot
+ * shrink the heap, so the top block is released like any other: its
+ * address range stays, its memory does not. The header, links and footer
+ * of a block are kept; the rest reads as zeroes when next used. Only the
+ * buckets of large blocks are walked, and only every trim_threshold bytes
+ * freed; a block stays marked RELEASED until it is merged or allocated.
+ * The caller holds the arena's lock.
+ */
+static void heap_release(void) {
+    freed_bytes = 0;
+    unsigned fl_bits = fl_bitmap & (~0u << get_class(RELEASE_MIN) / SL_COUNT);
+    for (; fl_bits; fl_bits &= fl_bits - 1) {
+        int fl = __builtin_ctz(fl_bits);
+        for (unsigned bits = sl_bitmap(fl); bits; bits &= bits - 1) {
+            for (char *bp = succeed(arena + (fl * SL_COUNT + __builtin_ctz(bits)) * WSIZE); bp; bp = succeed(bp)) {
+                // Blocks released before and not merged since are skipped
+                if (GET(HDRP(bp)) & RELEASED) {
+                    continue;
+                }
+                char *lo = (char *)PAGE_UP(bp + DSIZE);
+                char *hi = (char *)((size_t)FTRP(bp) & ~(size_t)(OS_PAGE - 1));
+                if (hi > lo) {
+                    madvise(lo, hi - lo, MADV_DONTNEED);
+                }
+                PUT(HDRP(bp), GET(HDRP(bp)) | RELEASED);
+                PUT(FTRP(bp), GET(FTRP(bp)) | RELEASED);
+            }
+        }
+    }
+}
+
+/*
+ * heap_resize - Resizes block bp to asize bytes, header included, without
+ * moving it. A shrink frees the tail if it is big enough to be a block. A
+ * growth takes the next block if it is free, and when the block or that
+ * free block ends the arena's newest segment, the heap is extended by only
+ * the missing bytes. The caller holds the lock of bp's arena.
+ * Returns 0 if the block cannot grow where it is.
+ */
+static int heap_resize(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(bp);
+    if (asize <= csize) {
+        // Split off the tail, as place() would, and free it
+        if (csize - asize > minsize) {
+            PUT(HDRP(bp), PACK(asize, get_prev_alloc(bp), 1));
+            void *tail = find_next_blankblock(bp);
+            PUT(HDRP(tail), PACK(csize - asize, 1, 1));
+            heap_free(tail);
+        }
+        return 1;
+    }
+    // Room up to the next allocated block
+    void *next = find_next_blankblock(bp);
+    size_t avail = csize + (GET_ALLOC(next) ? 0 : GET_SIZE(next));
+    void *end = GET_ALLOC(next) ? next : find_next_blankblock(next);
+    if (avail < asize && end == epilogue) {
+        // The new free block merges with the next block if the segment grew in place
+        if (extend_heap(MAX(asize - avail, minsize)) == (void *)-1) {
+            return 0;
+        }
+        next = find_next_blankblock(bp);
+        avail = csize + (GET_ALLOC(next) ? 0 : GET_SIZE(next));
+    }
+    if (avail < asize) {
+        return 0;
+    }
+    // Take the whole free block, then split off what is left over
+    delete(next);
+    PUT(HDRP(bp), PACK(avail, get_prev_alloc(bp), 1));
+    place(bp, asize);
+    return 1;
 }
 
 /*
  * realloc - Resizes the memory block pointed to by oldptr to size bytes.
- * Returns a new memory block with the requested size, with existing data copied.
+ * A block grows or shrinks in place when it can; otherwise returns a new
+ * memory block with the requested size, with existing data copied.
  * Frees oldptr and returns NULL if size is 0. 
  * If oldptr is NULL, it behaves like malloc.
  */
@@ -199,13 +523,31 @@ void *realloc(void *oldptr, size_t size) {
     if (!oldptr) {
         return malloc(size);
     }
-    // Align the requested size
-    size = size + WSIZE <= minsize ? minsize : ALIGN(size + WSIZE);
-    // Get the size of the old block
-    size_t old_size = GET_SIZE(oldptr);
-    // If the old block is big enough, return it
-    if (old_size >= size) {
-        return oldptr;
+    // Get the payload size of the old object or block
+    size_t old_size;
+    if (is_mapped(oldptr)) {
+        old_size = mmap_len(MMAP_OF(oldptr)) - MMAP_HEAD;
+        // A mapped block that stays large is remapped, which moves no data
+        if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+            return mmap_resize(oldptr, size);
+        }
+    } else if (is_slab(oldptr)) {
+        old_size = slab_size(SLAB_OF(oldptr));
+        // If the old object is big enough, return it
+        if (old_size >= size) {
+            return oldptr;
+        }
+    } else {
+        // A block is resized where it is if it can be; its header is only read
+        // under its arena's lock, since freeing a neighbour changes its bits
+        LOCK(get_owner(oldptr));
+        old_size = GET_SIZE(oldptr) - WSIZE;
+        int resized = size <= REQUEST_MAX
+                      && heap_resize(oldptr, size + WSIZE <= minsize ? minsize : ALIGN(size + WSIZE));
+        UNLOCK();
+        if (resized) {
+            return oldptr;
+        }
     }
     // Allocate a new block and check if the allocation was successful
     void *newptr = malloc(size);
@@ -245,113 +587,232 @@ void *calloc(size_t nmemb, size_t size) {
  * The function is called with the line number to track the location of the check.
  */
 void mm_checkheap(int lineno) {
+    // Each arena is checked as the current one; the caller may hold a lock
+    char *current = arena;
     // Print the heap pointer and line number if lineno is provided
     if (lineno)
         printf("heap (%p) in line (%d):\n", heap_listp, lineno);
-    // Check if the prologue block is within heap bounds
-    void *prologue = heap_listp - WSIZE;
-    if (prologue > mem_heap_hi() || prologue < mem_heap_lo()) {
-        printf("prologue not in heap\n");
-    }
-    // Check if the prologue block is allocated and has the correct size
-    if (!GET_ALLOC(prologue)) {
-        printf("prologue header without alloc\n");
-    }
-    if (GET_SIZE(prologue) != DSIZE) {
-        printf("prologue header with wrong size %d\n", GET_SIZE(prologue));
-    }
-    // Check if the epilogue block is correctly positioned and aligned
-    if ((mem_heap_hi() + 1) != epilogue) {
-        printf("epilogue header with wrong position %p instead of %p\n", epilogue, (mem_heap_hi() + 1));
-    }
-    if ((size_t)ALIGN(epilogue) != (size_t)epilogue) {
-        printf("epilogue header without align\n");
-    }
-    if (!GET_ALLOC(epilogue)) {
-        printf("epilogue header allocated wrongly \n");
-    }
-    if (GET_SIZE(epilogue)) {
-        printf("epilogue header with wrong size\n");
-    }
-    // Check if the size of the free list header array is correct
-    if (heap_listp - explicit_free_list != free_list_size * DSIZE + 2 * WSIZE) {
+    // Check if the size of the heap prelude is correct
+    if (heap_listp - explicit_free_list != PRELUDE_SIZE + 2 * DSIZE) {
         printf("incorrect free list header array size.\n");
     }
-    // Check each block in the free list
-    int free_list_count = 0;
-    for (int i = 0; i < free_list_size; i++) {
-        void *entry = explicit_free_list + i * DSIZE;
-        for (void *bp = succeed(entry); bp; bp = succeed(bp)) {
-            free_list_count++;
-            // Check if the block is within heap bounds and aligned
-            if (bp > mem_heap_hi() || bp < mem_heap_lo() || (size_t)ALIGN(bp) != (size_t)bp) {
-                printf("block not in heap or without aligned %p\n", bp);
+    for (int id = 0; id < ARENA_MAX; id++) {
+        if (!(arena = id ? ADDRESS(arena_table(id)) : explicit_free_list)) {
+            continue;
+        }
+        if (arena_id(arena) != (unsigned)id) {
+            printf("arena %d records index %u\n", id, arena_id(arena));
+        }
+        // Check each slab with free objects: linked both ways, and of its class
+        int partial_slabs = 0;
+        for (int c = 0; c < SLAB_CLASSES; c++) {
+            char *prev = NULL;
+            for (char *sl = ADDRESS(slab_list(c)); sl; prev = sl, sl = ADDRESS(slab_next(sl))) {
+                partial_slabs++;
+                if (!is_slab(sl) || slab_size(sl) != class_size(c) || !slab_nfree(sl)) {
+                    printf("slab %p on list %d is unmapped, of another class or full\n", sl, c);
+                }
+                if (ADDRESS(slab_prev(sl)) != prev) {
+                    printf("slab %p has predecessor %p instead of %p\n", sl, ADDRESS(slab_prev(sl)), prev);
+                }
+            }
+        }
+        // Check each block in the free list
+        int free_list_count = 0;
+        for (int i = 0; i < free_list_size; i++) {
+            void *entry = arena + i * WSIZE;
+            void *prev = NULL;
+            // Check if the bitmaps mark exactly the non-empty buckets
+            if (!GET(entry) != !(sl_bitmap(i / SL_COUNT) & (1 << (i % SL_COUNT)))) {
+                printf("bucket %d is %sempty but its bitmap bit says otherwise.\n", i, GET(entry) ? "not " : "");
+            }
+            if (!sl_bitmap(i / SL_COUNT) != !(fl_bitmap & (1u << (i / SL_COUNT)))) {
+                printf("first-level bitmap bit %d inconsistent.\n", i / SL_COUNT);
             }
+            for (void *bp = succeed(entry); bp; prev = bp, bp = succeed(bp)) {
+                free_list_count++;
+                // Check if the predecessor link mirrors the successor links
+                if (precede(bp) != prev) {
+                    printf("block %p has predecessor %p instead of %p\n", bp, precede(bp), prev);
+                }
+                // Check if the block is within heap bounds and aligned
+                if (bp > mem_heap_hi() || bp < mem_heap_lo() || (size_t)ALIGN(bp) != (size_t)bp) {
+                    printf("block not in heap or without aligned %p\n", bp);
+                }
 
-            // Check additional properties of the block
-            if (GET_ALLOC(bp)) {
-                printf("block allocated wrongly %p\n", bp);
+                // Check additional properties of the block
+                if (GET_ALLOC(bp)) {
+                    printf("block allocated wrongly %p\n", bp);
+                }
+                if (GET_SIZE(bp) < minsize) {
+                    printf("block too small %p %d\n", bp, GET_SIZE(bp));
+                }
+                if ((GET(HDRP(bp)) & (~0x2)) != (GET(FTRP(bp)) & (~0x2))) {
+                    printf("inconsistent block header and footer %x %x\n", GET(HDRP(bp)), GET(FTRP(bp)));
+                }
+                if (get_index(GET_SIZE(bp)) != entry) {
+                    printf("block falls into the wrong bucket.\n");
+                }
             }
-            if (GET_SIZE(bp) < minsize) {
-                printf("block too small %p %d\n", bp, GET_SIZE(bp));
+        }
+        // Check each segment of the arena, and its blocks in address order
+        for (char *seg = ADDRESS(segments); seg; seg = ADDRESS(GET(seg))) {
+            void *bp = seg + 2 * DSIZE;
+            // Check if the prologue block is allocated and has the correct size
+            void *prologue = (char *)bp - WSIZE;
+            if (!GET_ALLOC(prologue)) {
+                printf("prologue header without alloc\n");
+            }
+            if (GET_SIZE(prologue) != DSIZE) {
+                printf("prologue header with wrong size %d\n", GET_SIZE(prologue));
+            }
+            for (; GET_SIZE(bp) > 0; bp = find_next_blankblock(bp)) {
+                // Similar block checks as above
+                if (bp > mem_heap_hi() || bp < mem_heap_lo() || (size_t)ALIGN(bp) != (size_t)bp) {
+                    printf("block not in heap or without aligned %p\n", bp);
+                }
+                if (get_owner(bp) != arena) {
+                    printf("block %p of arena %d is mapped to another\n", bp, id);
+                }
+                if (GET_ALLOC(bp) && (GET(HDRP(bp)) & RELEASED)) {
+                    printf("allocated block %p marked released\n", bp);
+                }
+                // Check a slab's header against its bitmap
+                if (GET_ALLOC(bp) && is_slab(bp)) {
+                    int size = slab_size(bp), n = 0;
+                    for (int w = 0; w < SLAB_SIZE / DSIZE / 64; w++) {
+                        n += __builtin_popcountll(slab_bits(bp)[w]);
+                    }
+                    if (SLAB_OF(bp) != bp || size % DSIZE || size < DSIZE || size > SLAB_MAX || GET_SIZE(bp) < SLAB_SIZE) {
+                        printf("slab %p misaligned, too small or with object size %d\n", bp, size);
+                    } else if (n != slab_nfree(bp) || n > (int)SLAB_CAP(size) || (SLAB_CAP(size) < SLAB_SIZE / DSIZE && slab_bits(bp)[SLAB_CAP(size) / 64] >> (SLAB_CAP(size) % 64))) {
+                        printf("slab %p counts %d free objects, its bitmap %d\n", bp, slab_nfree(bp), n);
+                    }
+                    partial_slabs -= n > 0;
+                }
+                // Additional checks for free blocks
+                if (!GET_ALLOC(bp)) {
+                    free_list_count--;
+                    if (!GET_ALLOC(find_next_blankblock(bp))) {
+                        printf("Consecutive free blocks not coalesced.\n");
+                    }
+                }
+                // Check if the prev_alloc bit is consistent
+                if (GET_ALLOC(bp) != get_prev_alloc(find_next_blankblock(bp))) {
+                    printf("Prev_alloc bit inconsistent.\n");
+                    printf("Block in address %p is %s allocated, but the following block marked it otherwise.\n", bp, GET_ALLOC(bp) ? "" : "un");
+                }
+            }
+            // Check if the segment's epilogue is within the heap and aligned
+            if ((char *)bp > (char *)mem_heap_hi() + 1 || (size_t)ALIGN(bp) != (size_t)bp) {
+                printf("epilogue header with wrong position %p\n", bp);
             }
-            if ((GET(HDRP(bp)) & (~0x2)) != (GET(FTRP(bp)) & (~0x2))) {
-                printf("inconsistent block header and footer %x %x\n", GET(HDRP(bp)), GET(FTRP(bp)));
+            if (!GET_ALLOC(bp)) {
+                printf("epilogue header allocated wrongly \n");
             }
-            if (get_index(GET_SIZE(bp)) != entry) {
-                printf("block falls into the wrong bucket.\n");
+            // Verify the newest segment's epilogue is the arena's
+            if (seg == ADDRESS(segments) && bp != epilogue) {
+                printf("Incorrect epilogue location.\n");
             }
         }
-    }
-    // Check each block in address order
-    void *bp;
-    for (bp = heap_listp; GET_SIZE(bp) > 0; bp = find_next_blankblock(bp)) {
-        // Similar block checks as above
-        if (bp > mem_heap_hi() || bp < mem_heap_lo() || (size_t)ALIGN(bp) != (size_t)bp) {
-            printf("block not in heap or without aligned %p\n", bp);
-        }
-        // Additional checks for free blocks
-        if (!GET_ALLOC(bp)) {
-            free_list_count--;
-            if (!GET_ALLOC(find_next_blankblock(bp))) {
-                printf("Consecutive free blocks not coalesced.\n");
+        // Check if the free list count matches
+        if (free_list_count) {
+            printf("Free list total size and free block number don't match.\n");
+        }
+        if (partial_slabs) {
+            printf("slab lists and slabs with free objects don't match.\n");
+        }
+        // Blocks on the remote-free stack stay allocated until the arena takes them back
+        for (void *p = ADDRESS(remote_head(arena)); p; p = ADDRESS(GET(p))) {
+            if (!(is_slab(p) ? slab_taken(p) : GET_ALLOC(p)) || get_owner(p) != arena) {
+                printf("remote-freed block %p free or not of arena %d\n", p, id);
             }
         }
-        // Check if the prev_alloc bit is consistent
-        if (GET_ALLOC(bp) != get_prev_alloc(find_next_blankblock(bp))) {
-            printf("Prev_alloc bit inconsistent.\n");
-            printf("Block in address %p is %s allocated, but the following block marked it otherwise.\n", bp, GET_ALLOC(bp) ? "" : "un");
+    }
+    arena = current;
+    // Check the mapped blocks: whole pages outside the heap, linked both ways, and accounted for
+    size_t bytes = 0;
+    for (char *m = mapped, *prev = NULL; m; prev = m, m = mmap_next(m)) {
+        if (mmap_prev(m) != prev) {
+            printf("mapping %p has predecessor %p instead of %p\n", m, mmap_prev(m), prev);
+        }
+        if ((size_t)m % OS_PAGE || mmap_len(m) % OS_PAGE || mmap_len(m) <= MMAP_HEAD || !is_mapped(m + MMAP_HEAD)) {
+            printf("mapping %p of length %zu misaligned or in the heap\n", m, mmap_len(m));
         }
+        bytes += mmap_len(m);
     }
-    // Check if the free list count matches
-    if (free_list_count) {
-        printf("Free list total size and free block number don't match.\n");
+    if (bytes != mapped_bytes) {
+        printf("mappings hold %zu bytes, counted %zu\n", bytes, mapped_bytes);
     }
-    // Verify the epilogue block's location
-    if (bp != epilogue) {
-        printf("Incorrect epilogue location.\n");
+    // Check the objects in this thread's cache: allocated, and of their bin's class
+    if (tcache && tcache_gen == heap_gen) {
+        for (int b = 0; b < TCACHE_BINS; b++) {
+            int n = 0;
+            for (void *p = ADDRESS(tc_head(b)); p; p = ADDRESS(GET(p))) {
+                if (!is_slab(p) || slab_size(SLAB_OF(p)) != class_size(b) || !slab_taken(p)) {
+                    printf("cached object %p in wrong bin %d or free\n", p, b);
+                }
+                n++;
+            }
+            if (n != tc_count(b) || n > TCACHE_COUNT) {
+                printf("thread cache bin %d holds %d blocks, counted %d\n", b, n, tc_count(b));
+            }
+        }
     }
 }
 
 /* 
- * extend_heap - Extends the heap with a free block and returns its block pointer.
+ * extend_heap - Extends the current arena with a free block of at least
+ * words bytes and returns its block pointer. The arena's newest segment
+ * grows in place if it ends at the break; otherwise a new segment starts
+ * there. Segments of arenas after the first take whole owner map units.
  * This function is called when more heap space is needed.
  */
 static void *extend_heap(size_t words) {
     dbg_checkheap(__LINE__);
-    // Extend the heap by the requested number of words
-    void *bp = mem_sbrk(words);
+    int paged = arena != explicit_free_list;
+    int palloc = 1;
+    char *bp;
+    pthread_mutex_lock(sbrk_lock);
+    size_t brk = (char *)mem_heap_hi() + 1 - explicit_free_list;
+    if (epilogue == explicit_free_list + brk) {
+        // Extend the newest segment by the requested number of words
+        words = paged ? UNIT_ALIGN(words) : words;
+        bp = mem_sbrk(words);
+        // Retrieve the allocation status of the previous block
+        palloc = get_prev_alloc(epilogue);
+    } else {
+        // Start a segment: a link to the arena's previous one, a spare word, the prologue
+        size_t pad = paged ? UNIT_ALIGN(brk) - brk : 0;
+        words = paged ? UNIT_ALIGN(words + 2 * DSIZE) - 2 * DSIZE : words;
+        bp = mem_sbrk(pad + 2 * DSIZE + words);
+        if (bp != (void *)-1) {
+            char *seg = bp + pad;
+            PUT(seg, segments);
+            PUT(seg + WSIZE, 0);
+            PUT(seg + DSIZE, PACK(DSIZE, 1, 1)); // Prologue header
+            segments = OFFSET(seg);
+            bp = seg + 2 * DSIZE;
+        }
+    }
+    // Mark the units the block spans as this arena's
+    if (bp != (void *)-1 && paged) {
+        unsigned lo = OFFSET(bp) >> MAP_SHIFT, hi = (OFFSET(bp) + words) >> MAP_SHIFT;
+        memset((char *)ADDRESS(owner_map) + lo, arena_id(arena), hi - lo);
+    }
+    if (bp != (void *)-1) {
+        __atomic_store_n(&heap_end, (char *)mem_heap_hi() + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(sbrk_lock);
     // Check if memory allocation failed
     if (bp == (void*)-1) {
         return (void*)-1;
     }
-    // Retrieve the allocation status of the previous block
-    int palloc = get_prev_alloc(epilogue);
     // Initialize the header and footer of the new block
     PUT(HDRP(bp), PACK(words, palloc, 0)); // Header
     PUT(FTRP(bp), PACK(words, palloc, 0)); // Footer
     // Update the epilogue block's position
-    epilogue += words;
+    epilogue = bp + words;
     // Set the new epilogue header
     PUT(HDRP(epilogue), PACK(0, 0, 1));
     dbg_checkheap(__LINE__);
@@ -364,11 +825,13 @@ static void *extend_heap(size_t words) {
  * Returns a pointer to the coalesced block.
  */
 static void *coalesce(void *bp) {
-    // Find the previous and next blocks in the heap
-    void *prev = find_prev_blankblock(bp), *next = find_next_blankblock(bp);
     // Determine if the previous and next blocks are allocated
     size_t prev_alloc = get_prev_alloc(bp);
+    void *next = find_next_blankblock(bp);
     size_t next_alloc = GET_ALLOC(next);
+    // Only a free previous block has a footer; an allocated one's last word is
+    // payload, which another thread may be writing
+    void *prev = prev_alloc ? NULL : find_prev_blankblock(bp);
     // Get the size of the current block
     size_t size = GET_SIZE(bp);
     // Case 1: Both previous and next blocks are allocated
@@ -396,96 +859,130 @@ static void *coalesce(void *bp) {
     // Update the size in the header and footer of the coalesced block
     SET_SIZE(HDRP(bp), size);
     SET_SIZE(FTRP(bp), size);
+    // The freed part still holds its pages
+    RESET_RELEASED(HDRP(bp));
+    RESET_RELEASED(FTRP(bp));
     // Insert the coalesced block back into the free list
     return insert(bp);
 }
+/* 
+ * get_class - Determines the size class of a block of size asize.
+ * The first level is the power of two at or below asize, the second level
+ * which of its SL_COUNT equal ranges asize falls in.
+ */
+static int get_class(size_t asize) {
+    // Position of the highest set bit; asize is at least minsize
+    int fl = 31 - __builtin_clz((unsigned)asize);
+    // The SL_BITS bits below it select the range
+    int sl = (asize >> (fl - SL_BITS)) & (SL_COUNT - 1);
+    return (fl - FL_MIN) * SL_COUNT + sl;
+}
+
 /* 
  * get_index - Determines the index in the explicit free list for a block of size asize.
  * This function helps in segregating free blocks based on their sizes.
  */
 static void *get_index(size_t asize) {
-    // Determine the index based on the size of the block
-    int i = 0;
-    // For very large sizes, use the last index
-    if (asize >= (1 << 12)) {
-        return explicit_free_list + DSIZE * free_list_size - DSIZE;
-    }
-    // Right-shift the size to find the appropriate index
-    asize = asize >> 4;
-    while (asize > 1) {
-        asize = asize >> 1;
-        i++;
-    }
     // Return the pointer to the appropriate free list bucket
-    return explicit_free_list + i * DSIZE;
+    return arena + get_class(asize) * WSIZE;
 }
 
 /* 
  * find_fit - Finds a fit for a block with size bytes in the explicit free list.
- * It searches the free list for a block that is large enough to accommodate the requested size.
+ * Blocks of the request's own class may be too small, so the first few are
+ * tried. Otherwise every block of a higher class fits, and the bitmaps give
+ * the first non-empty one directly.
  * Returns a pointer to the fitting block, or NULL if no fitting block is found.
  */
 static void *find_fit(size_t size) {
-    // Find the appropriate free list bucket based on size
-    void *entry = get_index(size);
-    // Iterate through the free list to find a suitable block
-    void *p = succeed(entry);
-    while (p) {
-        // If a block is large enough, return it
-        if (GET_SIZE(p) >= size) {
-            return p;
-        }
-        p = succeed(p);
-    }
-    // Iterate through the rest of the free list buckets if no block is found in the first pass
-    char *p2 = entry + DSIZE;
-    while (p2 != free_list_end) {
-        if (succeed(p2))
-            return succeed(p2);
-        p2 += DSIZE;
-    }
-    // Return NULL if no suitable block is found
-    return NULL;
+    int class = get_class(size);
+    int fl = class / SL_COUNT;
+    // Try the request's own class
+    void *p = fit_bucket(succeed(arena + class * WSIZE), size);
+    if (p) {
+        return p;
+    }
+    // Look for a non-empty higher class of the same power of two
+    unsigned bits = sl_bitmap(fl) & (~0u << (class % SL_COUNT + 1));
+    if (!bits) {
+        // Then for the next power of two with any non-empty class
+        unsigned fl_bits = fl_bitmap & (~0u << (fl + 1));
+        if (!fl_bits) {
+            return NULL; // Return NULL if no suitable block is found
+        }
+        fl = __builtin_ctz(fl_bits);
+        bits = sl_bitmap(fl);
+    }
+    return fit_bucket(succeed(arena + (fl * SL_COUNT + __builtin_ctz(bits)) * WSIZE), size);
+}
+
+/* 
+ * fit_bucket - Chooses a block of at least size bytes among the first
+ * FIT_LOOKAHEAD blocks of the bucket list starting at bp, by fit_policy:
+ * the first, the smallest (an exact fit ends the search), or the lowest in
+ * memory, which keeps the top of the heap free to be released.
+ * Returns NULL if none of them fits.
+ */
+static void *fit_bucket(void *bp, size_t size) {
+    void *fit = NULL;
+    for (int k = 0; bp && k < FIT_LOOKAHEAD; k++, bp = succeed(bp)) {
+        if (GET_SIZE(bp) < size) {
+            continue;
+        }
+        if (fit_policy == FIT_FIRST || GET_SIZE(bp) == size) {
+            return bp;
+        }
+        if (!fit || (fit_policy == FIT_BEST ? GET_SIZE(bp) < GET_SIZE(fit) : bp < fit)) {
+            fit = bp;
+        }
+    }
+    return fit;
 }
 /* 
  * insert - Inserts a block into the explicit free list.
- * The function places the block in the appropriate position based on its size
- * to maintain the order of blocks within each free list bucket.
+ * The block is pushed on the front of its bucket, in constant time; the
+ * search does the choosing.
+ * The first block of a bucket has no predecessor; the bucket entry only
+ * holds a successor link.
  */
 static void *insert(void *bp) {
-    // Find the appropriate free list bucket for the block
-    void *entry = get_index(GET_SIZE(bp));
-    // Iterate through the free list to find the correct position for insertion
-    void *p = entry, *sucp;
-    sucp = succeed(p);
-    while (sucp && GET_SIZE(sucp) < GET_SIZE(bp)) {
-        p = sucp;
-        sucp = succeed(p);
-    }
-    // Insert the block into the free list
+    // Find the appropriate free list bucket for the block, and mark it non-empty
+    int class = get_class(GET_SIZE(bp));
+    void *entry = arena + class * WSIZE;
+    sl_bitmap(class / SL_COUNT) |= 1 << (class % SL_COUNT);
+    fl_bitmap |= 1u << (class / SL_COUNT);
+    // Push the block in front of the bucket's first
+    void *sucp = succeed(entry);
     put_suc(bp, sucp); // Set bp's successor
-    put_suc(p, bp);    // Update the previous block's successor
+    put_pre(bp, NULL); // The first block has no predecessor
+    put_suc(entry, bp); // The bucket now starts with bp
+    if (sucp) {
+        put_pre(sucp, bp); // Update the next block's predecessor
+    }
     // Return the block pointer
     return bp;
 }
 
 /* 
  * delete - Removes a block from the explicit free list.
- * The function finds the block in the free list and adjusts pointers
- * to exclude it from the list.
+ * The function links the block's neighbours in the list to each other,
+ * in constant time, and clears the bitmap bits of a bucket it empties.
  */
 static void delete(void *bp) {
-    // Find the appropriate free list bucket for the block
-    void *entry = get_index(GET_SIZE(bp));
-    // Iterate through the free list to find the block
-    void *p = entry, *succp;
-    succp = succeed(p);
-    while (succp && succp != bp) {
-        p = succp;
-        succp = succeed(p);
+    void *prep = precede(bp), *succp = succeed(bp);
+    if (prep) {
+        put_suc(prep, succp); // Update the predecessor's successor
+    } else {
+        // The first block's predecessor is its bucket entry
+        int class = get_class(GET_SIZE(bp));
+        put_suc(arena + class * WSIZE, succp);
+        if (!succp && !(sl_bitmap(class / SL_COUNT) &= ~(1 << (class % SL_COUNT)))) {
+            fl_bitmap &= ~(1u << (class / SL_COUNT)); // Last class of its power of two emptied
+        }
+    }
+    if (succp) {
+        put_pre(succp, prep); // Update the successor's predecessor
     }
-    // Remove the block from the free list
-    put_suc(p, succeed(bp)); // Update the predecessor's successor
 }
 /* 
  * place - Allocates a block of asize bytes within the free block pointed by bp.
@@ -501,19 +998,560 @@ static void *place(void *bp, size_t asize) {
     // If the remainder is too small to be a separate block, allocate the entire block
     if (remainder <= minsize) {
         SET_ALLOC(HDRP(bp)); // Mark the block as allocated
+        RESET_RELEASED(HDRP(bp));
         SET_PALLOC(HDRP(find_next_blankblock(bp))); // Set the previous-allocated bit of the next block
         return result;
     }
     else {
-        // Allocate part of the block and update its header
+        // Allocate part of the block and update its header; the rest keeps its released state
+        unsigned released = GET(HDRP(bp)) & RELEASED;
         PUT(HDRP(bp), PACK(asize, get_prev_alloc(bp), 1));
         // Find and set up the remaining part as a new free block
         bp = find_next_blankblock(bp); // Move bp to the start of the new free block
-        PUT(HDRP(bp), PACK(remainder, 1, 0)); // Set the header of the new free block
-        PUT(FTRP(bp), PACK(remainder, 1, 0)); // Set the footer of the new free block
+        PUT(HDRP(bp), PACK(remainder, 1, 0) | released); // Set the header of the new free block
+        PUT(FTRP(bp), PACK(remainder, 1, 0) | released); // Set the footer of the new free block
         // Insert the new free block into the free list
         insert(bp);
         // Return the pointer to the allocated block
         return result;
     }
-}
\ No newline at end of file
+}
+
+/* 
+ * tcache_self - Returns this thread's cache, allocating it from the heap on
+ * first use, or again after mm_init started a new heap.
+ * Returns NULL if the heap cannot hold one; the thread then goes to the heap.
+ */
+static char *tcache_self(void) {
+    if (tcache && tcache_gen == heap_gen) {
+        return tcache;
+    }
+    LOCK(pick_arena());
+    tcache = heap_alloc(TCACHE_SIZE);
+    UNLOCK();
+    if (!tcache) {
+        return NULL;
+    }
+    // Every bin starts empty, refilling one block at a time
+    memset(tcache, 0, TCACHE_BINS * DSIZE);
+    for (int b = 0; b < TCACHE_BINS; b++) {
+        tc_fill(b) = 1;
+    }
+    tcache_gen = heap_gen;
+    pthread_setspecific(tcache_key, tcache);
+    return tcache;
+}
+
+/* 
+ * tcache_get - Takes an object of slab class b from this thread's cache.
+ * An empty bin is refilled with a batch of objects under one hold of its
+ * arena's lock; each refill in a row doubles the batch, up to half a bin.
+ * Returns NULL if there is no cache or the heap is out of memory.
+ */
+static void *tcache_get(int b) {
+    void *bp;
+    if (!tcache_self()) {
+        return NULL;
+    }
+    if (!tc_count(b)) {
+        LOCK(pick_arena());
+        while (tc_count(b) < tc_fill(b) && (bp = slab_alloc(b)) != NULL) {
+            PUT(bp, tc_head(b)); // Cached objects are linked through their payload
+            tc_head(b) = OFFSET(bp);
+            tc_count(b)++;
+        }
+        UNLOCK();
+        if (!tc_count(b)) {
+            return NULL;
+        }
+        tc_fill(b) = MIN(tc_fill(b) * 2, TCACHE_COUNT / 2);
+    }
+    // Pop the most recently cached block
+    bp = ADDRESS(tc_head(b));
+    tc_head(b) = GET(bp);
+    tc_count(b)--;
+    return bp;
+}
+
+/* 
+ * tcache_put - Keeps the freed slab object bp in this thread's cache, still
+ * marked allocated in its slab. A full bin first returns its older half to
+ * the heap, taking this thread's arena lock once.
+ * Returns 0 if the thread has no cache, and the caller frees bp itself.
+ */
+static int tcache_put(void *bp) {
+    int b = slab_class(slab_size(SLAB_OF(bp)));
+    if (!tcache_self()) {
+        return 0;
+    }
+    if (tc_count(b) == TCACHE_COUNT) {
+        // Keep the newest half: the blocks most likely still in the CPU cache
+        void *p = ADDRESS(tc_head(b)), *next;
+        for (int i = 1; i < TCACHE_COUNT / 2; i++) {
+            p = ADDRESS(GET(p));
+        }
+        next = ADDRESS(GET(p));
+        PUT(p, 0);
+        free_chain(next);
+        tc_count(b) = TCACHE_COUNT / 2;
+        tc_fill(b) = 1; // This thread frees more than it allocates
+    }
+    PUT(bp, tc_head(b));
+    tc_head(b) = OFFSET(bp);
+    tc_count(b)++;
+    return 1;
+}
+
+/* 
+ * tcache_release - Called when a thread exits with the cache tc: returns
+ * every cached block, and the cache itself, to the heap. A cache left from
+ * before mm_init started a new heap is simply forgotten.
+ */
+static void tcache_release(void *tc) {
+    if (tc != tcache || tcache_gen != heap_gen) {
+        return;
+    }
+    for (int b = 0; b < TCACHE_BINS; b++) {
+        free_chain(ADDRESS(tc_head(b)));
+    }
+    PUT(tcache, 0);
+    free_chain(tcache);
+    tcache = NULL;
+}
+
+/* 
+ * get_arena - Returns arena id, making it on first use: its free lists
+ * and lock come from the break, and the first arena after the main one
+ * also brings the owner map. Returns the main arena if there is no room.
+ */
+static char *get_arena(int id) {
+    unsigned off = __atomic_load_n(&arena_table(id), __ATOMIC_ACQUIRE);
+    if (off || !id) {
+        return id ? ADDRESS(off) : explicit_free_list;
+    }
+    pthread_mutex_lock(sbrk_lock);
+    if (!(off = arena_table(id))) {
+        size_t size = ARENA_SIZE + (owner_map ? 0 : MAP_SIZE);
+        char *a = mem_sbrk(size);
+        if (a != (void *)-1) {
+            // Until a unit is marked, it belongs to the main arena
+            memset(a, 0, size);
+            pthread_mutex_init(arena_lock(a), NULL);
+            arena_id(a) = id;
+            if (!owner_map) {
+                __atomic_store_n(&owner_map, OFFSET(a + ARENA_SIZE), __ATOMIC_RELEASE);
+            }
+            off = OFFSET(a);
+            __atomic_store_n(&arena_table(id), off, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(sbrk_lock);
+    return off ? ADDRESS(off) : explicit_free_list;
+}
+
+/* 
+ * pick_arena - Returns the arena this thread allocates from: the main one
+ * until a thread other than mm_init's uses the heap, so a single-threaded
+ * program keeps one heap wherever it is scheduled, and from then on the
+ * arena of the CPU this thread is running on. It is asked on each trip to
+ * the heap, so a thread that moves to another CPU follows it to that
+ * CPU's arena.
+ */
+static char *pick_arena(void) {
+    if (!__atomic_load_n(&multi_thread, __ATOMIC_RELAXED)) {
+        if (pthread_equal(pthread_self(), init_thread)) {
+            return explicit_free_list;
+        }
+        __atomic_store_n(&multi_thread, 1, __ATOMIC_RELAXED);
+    }
+    int cpu = sched_getcpu();
+    return get_arena(cpu > 0 ? cpu % ARENA_MAX : 0);
+}
+
+/* 
+ * get_owner - Returns the arena block bp belongs to. Segments of arenas
+ * after the first are whole owner map units, and everything else is the
+ * main arena's.
+ */
+static char *get_owner(void *bp) {
+    unsigned map = __atomic_load_n(&owner_map, __ATOMIC_ACQUIRE);
+    if (!map) {
+        return explicit_free_list;
+    }
+    int id = __atomic_load_n((unsigned char *)ADDRESS(map) + (OFFSET(bp) >> MAP_SHIFT), __ATOMIC_RELAXED);
+    return id ? ADDRESS(__atomic_load_n(&arena_table(id), __ATOMIC_ACQUIRE)) : explicit_free_list;
+}
+
+/* 
+ * free_chain - Frees the blocks of a chain linked through their payloads.
+ * Blocks of this thread's arena are freed under one hold of its lock; any
+ * other block goes on its own arena's remote-free stack.
+ */
+static void free_chain(void *bp) {
+    char *a = pick_arena(), *owner;
+    int locked = 0;
+    for (void *next; bp; bp = next) {
+        next = ADDRESS(GET(bp));
+        if ((owner = get_owner(bp)) != a) {
+            remote_free(owner, bp);
+            continue;
+        }
+        if (!locked) {
+            LOCK(a);
+            locked = 1;
+        }
+        arena_free(bp);
+    }
+    if (locked) {
+        UNLOCK();
+    }
+}
+
+/* 
+ * remote_free - Pushes block bp on arena a's remote-free stack, without
+ * taking a's lock. The block stays marked allocated until a drains it.
+ */
+static void remote_free(char *a, void *bp) {
+    unsigned head = __atomic_load_n(&remote_head(a), __ATOMIC_RELAXED);
+    do {
+        PUT(bp, head);
+    } while (!__atomic_compare_exchange_n(&remote_head(a), &head, OFFSET(bp), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* 
+ * drain_remote - Takes the whole remote-free stack of the current arena
+ * and frees its blocks. The caller holds the arena's lock. Producers only
+ * ever push, so taking the stack in one exchange cannot lose a block.
+ */
+static void drain_remote(void) {
+    unsigned off = __atomic_exchange_n(&remote_head(arena), 0, __ATOMIC_ACQUIRE);
+    for (void *bp = ADDRESS(off), *next; bp; bp = next) {
+        next = ADDRESS(GET(bp));
+        arena_free(bp);
+    }
+}
+
+/* 
+ * arena_free - Frees bp into the current arena: a slab object into its
+ * slab, or a block into the free lists. The caller holds the arena's lock.
+ */
+static void arena_free(void *bp) {
+    if (is_slab(bp)) {
+        slab_free(bp);
+    } else {
+        heap_free(bp);
+    }
+}
+
+/* 
+ * is_slab - Checks the slab map for the page of p. The map is a root of
+ * leaf offsets, one per 64MB of heap, and leaves with a bit per page, all
+ * allocated from the heap as slabs first appear in their span.
+ * Returns 1 if p is in a slab, 0 if not.
+ */
+static int is_slab(void *p) {
+    unsigned root = __atomic_load_n(&slab_map, __ATOMIC_ACQUIRE), off = OFFSET(p), leaf;
+    if (!root) {
+        return 0;
+    }
+    leaf = __atomic_load_n((unsigned *)ADDRESS(root) + (off >> LEAF_SHIFT), __ATOMIC_ACQUIRE);
+    if (!leaf) {
+        return 0;
+    }
+    unsigned page = (off & ((1u << LEAF_SHIFT) - 1)) / SLAB_SIZE;
+    return (__atomic_load_n((unsigned *)ADDRESS(leaf) + page / 32, __ATOMIC_RELAXED) >> (page % 32)) & 1;
+}
+
+/* 
+ * slab_mark - Sets (on) or clears the slab map bit of the page at s, making
+ * the map's root and the page's leaf from the current arena if they are
+ * missing. Arenas race to make them; the loser frees its copy.
+ * Returns -1 if the heap has no room for them, 0 on success.
+ */
+static int slab_mark(char *s, int on) {
+    unsigned *slot = &slab_map, off = OFFSET(s), node;
+    for (int level = 0; level < 2; level++) {
+        size_t size = level ? LEAF_SIZE : ROOT_SIZE;
+        if (!(node = __atomic_load_n(slot, __ATOMIC_ACQUIRE))) {
+            char *bp = heap_alloc(ALIGN(size + WSIZE));
+            if (!bp) {
+                return -1;
+            }
+            memset(bp, 0, size);
+            if (__atomic_compare_exchange_n(slot, &node, OFFSET(bp), 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                node = OFFSET(bp);
+            } else {
+                heap_free(bp); // node now holds the winner's
+            }
+        }
+        // Then down to the leaf of s's span
+        slot = (unsigned *)ADDRESS(node) + (level ? 0 : off >> LEAF_SHIFT);
+    }
+    unsigned page = (off & ((1u << LEAF_SHIFT) - 1)) / SLAB_SIZE;
+    unsigned *word = slot + page / 32;
+    if (on) {
+        __atomic_fetch_or(word, 1u << (page % 32), __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(word, ~(1u << (page % 32)), __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* 
+ * slab_class - Returns the slab class of a request of size bytes. Classes
+ * are DSIZE apart up to SLAB_SMALL; above it each power of two is split
+ * into SL_COUNT classes, as it is for the free lists.
+ */
+static int slab_class(size_t size) {
+    if (size <= SLAB_SMALL) {
+        return (size - 1) / DSIZE;
+    }
+    // size is above the fl-th power of two and at most the next
+    int fl = 31 - __builtin_clz((unsigned)size - 1);
+    return SLAB_SMALL / DSIZE + (fl - __builtin_ctz(SLAB_SMALL)) * SL_COUNT
+           + ((size - 1) >> (fl - SL_BITS)) - SL_COUNT;
+}
+
+/* 
+ * class_size - Returns the object size of slab class cls: the largest
+ * request of the class.
+ */
+static size_t class_size(int cls) {
+    if (cls < SLAB_SMALL / DSIZE) {
+        return (cls + 1) * DSIZE;
+    }
+    cls -= SLAB_SMALL / DSIZE;
+    int fl = __builtin_ctz(SLAB_SMALL) + cls / SL_COUNT;
+    return (size_t)(SL_COUNT + 1 + cls % SL_COUNT) << (fl - SL_BITS);
+}
+
+/* 
+ * slab_new - Carves a page-aligned block for a slab of class cls from the
+ * current arena and puts it at the head of the class's list. The parts of
+ * the fitting block before and after the slab stay free. A page-sized fit
+ * is tried first, then one large enough for any alignment, then the heap
+ * is extended by just what a slab at its end needs.
+ * Returns the slab, or NULL if the heap cannot grow.
+ */
+static void *slab_new(int cls) {
+    size_t need = 2 * SLAB_SIZE + minsize, size = class_size(cls);
+    char *bp = find_fit(SLAB_SIZE);
+    if (!bp || !slab_fits(bp)) {
+        bp = find_fit(need);
+    }
+    if (!bp && epilogue) {
+        // The arena's last free block, if any, merges with the extension
+        char *last = get_prev_alloc(epilogue) ? epilogue : find_prev_blankblock(epilogue);
+        bp = extend_heap(MAX(slab_align(last) + SLAB_SIZE - epilogue, minsize));
+        if (bp != (void *)-1 && !slab_fits(bp)) {
+            bp = NULL; // The extension started a new segment
+        }
+    }
+    if (!bp || bp == (void *)-1) {
+        if (bp || (bp = extend_heap(need)) == (void *)-1) {
+            return NULL;
+        }
+    }
+    delete(bp);
+    size_t csize = GET_SIZE(bp), palloc = get_prev_alloc(bp);
+    char *s = slab_align(bp);
+    size_t front = s - bp, back = bp + csize - (s + SLAB_SIZE);
+    if (front) {
+        PUT(HDRP(bp), PACK(front, palloc, 0));
+        PUT(FTRP(bp), PACK(front, palloc, 0));
+        insert(bp);
+    }
+    // A tail too small for a block stays with the slab
+    if (back < minsize) {
+        PUT(HDRP(s), PACK(SLAB_SIZE + back, front ? 0 : palloc, 1));
+        SET_PALLOC(HDRP(find_next_blankblock(s)));
+    } else {
+        PUT(HDRP(s), PACK(SLAB_SIZE, front ? 0 : palloc, 1));
+        PUT(HDRP(s + SLAB_SIZE), PACK(back, 1, 0));
+        PUT(FTRP(s + SLAB_SIZE), PACK(back, 1, 0));
+        insert(s + SLAB_SIZE);
+    }
+    if (slab_mark(s, 1) < 0) {
+        heap_free(s);
+        return NULL;
+    }
+    // Every object starts free
+    memset(s, 0, SLAB_HEAD);
+    slab_size(s) = size;
+    slab_nfree(s) = SLAB_CAP(size);
+    for (unsigned i = 0; i < SLAB_CAP(size); i++) {
+        slab_bits(s)[i / 64] |= 1ULL << (i % 64);
+    }
+    slab_next(s) = slab_list(cls);
+    if (slab_list(cls)) {
+        slab_prev(ADDRESS(slab_list(cls))) = OFFSET(s);
+    }
+    slab_list(cls) = OFFSET(s);
+    return s;
+}
+
+/* 
+ * slab_align - Returns where a slab would start in free block bp: the first
+ * page boundary leaving either nothing or room for a free block before it.
+ */
+static char *slab_align(char *bp) {
+    char *s = SLAB_OF(bp + SLAB_SIZE - 1);
+    if (s != bp && s - bp < minsize) {
+        s += SLAB_SIZE;
+    }
+    return s;
+}
+
+/* 
+ * slab_alloc - Takes a free object of class cls from the first slab of the
+ * current arena's list, making a slab if there is none. A slab that runs
+ * out of free objects leaves the list. The caller holds the arena's lock.
+ * Returns NULL if the heap cannot grow.
+ */
+static void *slab_alloc(int cls) {
+    // First take back the objects other threads freed into this arena
+    if (__atomic_load_n(&remote_head(arena), __ATOMIC_RELAXED)) {
+        drain_remote();
+    }
+    char *s = ADDRESS(slab_list(cls));
+    if (!s && !(s = slab_new(cls))) {
+        return NULL;
+    }
+    int w = 0;
+    while (!slab_bits(s)[w]) {
+        w++;
+    }
+    int i = w * 64 + __builtin_ctzll(slab_bits(s)[w]);
+    slab_bits(s)[w] &= slab_bits(s)[w] - 1; // Clear the lowest set bit
+    if (!--slab_nfree(s)) {
+        slab_list(cls) = slab_next(s);
+        if (slab_next(s)) {
+            slab_prev(ADDRESS(slab_next(s))) = 0;
+        }
+    }
+    return s + SLAB_HEAD + i * slab_size(s);
+}
+
+/* 
+ * slab_free - Returns object p to its slab. A full slab goes back on its
+ * class's list; an empty one is freed as a block, unless it is the only
+ * slab of its class in the arena. The caller holds the owning arena's lock.
+ */
+static void slab_free(void *p) {
+    char *s = SLAB_OF(p);
+    int size = slab_size(s), cls = slab_class(size), i = slab_index(p);
+    slab_bits(s)[i / 64] |= 1ULL << (i % 64);
+    if (!slab_nfree(s)++) {
+        slab_prev(s) = 0;
+        slab_next(s) = slab_list(cls);
+        if (slab_list(cls)) {
+            slab_prev(ADDRESS(slab_list(cls))) = OFFSET(s);
+        }
+        slab_list(cls) = OFFSET(s);
+    } else if (slab_nfree(s) == SLAB_CAP(size) && (slab_prev(s) || slab_next(s))) {
+        if (slab_prev(s)) {
+            slab_next(ADDRESS(slab_prev(s))) = slab_next(s);
+        } else {
+            slab_list(cls) = slab_next(s);
+        }
+        if (slab_next(s)) {
+            slab_prev(ADDRESS(slab_next(s))) = slab_prev(s);
+        }
+        slab_mark(s, 0);
+        heap_free(s);
+    }
+}
+
+/* 
+ * mmap_alloc - Maps a block of its own for a request of size bytes. The
+ * mapping starts with its list links and length; mappings of HUGE_MIN
+ * bytes or more are backed by huge pages where the system has them.
+ * Returns NULL if the mapping fails.
+ */
+static void *mmap_alloc(size_t size) {
+    size_t len = PAGE_UP(size + MMAP_HEAD);
+    char *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        return NULL;
+    }
+    if (len >= HUGE_MIN) {
+        madvise(m, len, MADV_HUGEPAGE);
+    }
+    mmap_len(m) = len;
+    mmap_prev(m) = NULL;
+    pthread_mutex_lock(sbrk_lock);
+    mmap_next(m) = mapped;
+    if (mapped) {
+        mmap_prev(mapped) = m;
+    }
+    mapped = m;
+    mapped_bytes += len;
+    pthread_mutex_unlock(sbrk_lock);
+    return m + MMAP_HEAD;
+}
+
+/* 
+ * mmap_free - Unmaps mapped block bp. A block larger than the threshold
+ * raises it, so that blocks of its size are taken from the heap from now
+ * on instead of being mapped and unmapped over and over, and sets the trim
+ * threshold to twice that.
+ */
+static void mmap_free(void *bp) {
+    char *m = MMAP_OF(bp);
+    size_t len = mmap_len(m);
+    pthread_mutex_lock(sbrk_lock);
+    if (mmap_prev(m)) {
+        mmap_next(mmap_prev(m)) = mmap_next(m);
+    } else {
+        mapped = mmap_next(m);
+    }
+    if (mmap_next(m)) {
+        mmap_prev(mmap_next(m)) = mmap_prev(m);
+    }
+    mapped_bytes -= len;
+    pthread_mutex_unlock(sbrk_lock);
+    if (len - MMAP_HEAD > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) && len - MMAP_HEAD <= MMAP_MAX) {
+        __atomic_store_n(&mmap_threshold, len - MMAP_HEAD, __ATOMIC_RELAXED);
+        // Blocks of that size now churn in the heap; release less often, as glibc does
+        __atomic_store_n(&trim_threshold, 2 * (len - MMAP_HEAD), __ATOMIC_RELAXED);
+    }
+    munmap(m, len);
+}
+
+/* 
+ * mmap_resize - Resizes mapped block bp to hold size bytes. The kernel
+ * moves the pages if the mapping cannot grow where it is, so the data is
+ * never copied. The mapping's neighbours in the list are relinked to it.
+ * Returns the block, possibly moved, or NULL if it cannot be remapped.
+ */
+static void *mmap_resize(void *bp, size_t size) {
+    char *m = MMAP_OF(bp);
+    size_t len = mmap_len(m), new_len = PAGE_UP(size + MMAP_HEAD);
+    if (new_len == len) {
+        return bp;
+    }
+    // The list is held while the mapping may move
+    pthread_mutex_lock(sbrk_lock);
+    char *n = mremap(m, len, new_len, MREMAP_MAYMOVE);
+    if (n == MAP_FAILED) {
+        pthread_mutex_unlock(sbrk_lock);
+        return NULL;
+    }
+    if (mmap_prev(n)) {
+        mmap_next(mmap_prev(n)) = n;
+    } else {
+        mapped = n;
+    }
+    if (mmap_next(n)) {
+        mmap_prev(mmap_next(n)) = n;
+    }
+    mmap_len(n) = new_len;
+    mapped_bytes += new_len - len;
+    pthread_mutex_unlock(sbrk_lock);
+    if (new_len >= HUGE_MIN && len < HUGE_MIN) {
+        madvise(n, new_len, MADV_HUGEPAGE);
+    }
+    return n + MMAP_HEAD;
+}
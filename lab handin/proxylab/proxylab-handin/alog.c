@@ -0,0 +1,201 @@
+/*
+ * alog.c - asynchronous access log (see alog.h)
+ */
+#include "csapp.h"
+#include "alog.h"
+#include <stdatomic.h>
+#include <time.h>
+
+typedef struct {
+    long long ms;               /* Wall-clock time of the event */
+    long long bytes;            /* Response bytes sent to the client */
+    long long usec;             /* Time spent serving the request */
+    int status;                 /* HTTP status, 0 for a plain message */
+    int hit;                    /* Where it came from: ALOG_MISS, ALOG_HIT, ALOG_PEER */
+    char text[ALOG_TEXT_MAX];   /* "METHOD URI" or message */
+} alog_rec_t;
+
+typedef struct alog_ring {
+    _Atomic unsigned head;      /* Next slot the owning thread fills */
+    _Atomic unsigned tail;      /* Next slot the writer drains */
+    _Atomic unsigned long dropped; /* Records lost to a full ring or the rate limit */
+    unsigned long seen;         /* Requests offered, for sampling */
+    double tokens;              /* Rate limiter bucket */
+    long long refill_ms;        /* Last time tokens were added */
+    struct alog_ring *next;     /* All rings, for the writer */
+    alog_rec_t recs[ALOG_RING_SLOTS];
+} alog_ring_t;
+
+static const char *hit_names[] = { "MISS", "HIT", "PEER" };
+static FILE *alog_fp;
+static int alog_sample = 1;     /* Log one request in this many */
+static int alog_rate;           /* Max records per second per thread, 0 = no limit */
+static _Atomic(alog_ring_t *) alog_rings;
+static __thread alog_ring_t *my_ring;
+
+static void *alog_writer(void *vargp);
+
+static long long now_ms(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Open the log (stdout if path is NULL) and start the writer thread */
+void alog_init(const char *path, int sample_every, int rate_per_sec)
+{
+    pthread_t tid;
+
+    alog_fp = stdout;
+    if (path && (alog_fp = fopen(path, "ae")) == NULL) { /* Not inherited by an upgrade */
+        fprintf(stderr, "cannot open access log %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    alog_sample = sample_every > 0 ? sample_every : 1;
+    alog_rate = rate_per_sec > 0 ? rate_per_sec : 0;
+    Pthread_create(&tid, NULL, alog_writer, NULL);
+}
+
+/* Find (or lazily create and publish) the calling thread's ring */
+static alog_ring_t *get_ring(void)
+{
+    alog_ring_t *r = my_ring, *head;
+
+    if (r)
+        return r;
+    r = Calloc(1, sizeof(alog_ring_t));
+    r->tokens = alog_rate;
+    r->refill_ms = now_ms(CLOCK_MONOTONIC_COARSE);
+    head = atomic_load(&alog_rings);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak(&alog_rings, &head, r));
+    return my_ring = r;
+}
+
+/* Reserve the next free slot, or count a drop and return NULL */
+static alog_rec_t *reserve(alog_ring_t *r)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head - tail == ALOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &r->recs[head % ALOG_RING_SLOTS];
+}
+
+/* Hand the slot returned by reserve() to the writer */
+static void publish(alog_ring_t *r, alog_rec_t *rec)
+{
+    rec->ms = now_ms(CLOCK_REALTIME_COARSE);
+    atomic_store_explicit(&r->head, atomic_load_explicit(&r->head, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/* Token bucket: return 1 if the thread may log another record now */
+static int admit(alog_ring_t *r)
+{
+    long long now;
+
+    if (!alog_rate)
+        return 1;
+    now = now_ms(CLOCK_MONOTONIC_COARSE);
+    r->tokens += (now - r->refill_ms) * alog_rate / 1000.0;
+    r->refill_ms = now;
+    if (r->tokens > alog_rate)
+        r->tokens = alog_rate;
+    if (r->tokens < 1) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+    r->tokens -= 1;
+    return 1;
+}
+
+/* Record one served request, subject to sampling and rate limiting */
+void alog_request(const char *method, const char *uri, int status,
+                  long long bytes, int hit, long long usec)
+{
+    alog_ring_t *r = get_ring();
+    alog_rec_t *rec;
+
+    if (r->seen++ % alog_sample || !admit(r) || !(rec = reserve(r)))
+        return;
+    snprintf(rec->text, ALOG_TEXT_MAX, "%s %s", method, uri);
+    rec->status = status;
+    rec->bytes = bytes;
+    rec->hit = hit;
+    rec->usec = usec;
+    publish(r, rec);
+}
+
+/* Record a free-form message line; before alog_init() it goes to stderr */
+void alog_msg(const char *fmt, ...)
+{
+    alog_ring_t *r;
+    alog_rec_t *rec;
+    va_list ap;
+
+    if (!alog_fp) {             /* No writer thread, e.g. in the -w supervisor */
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+    r = get_ring();
+    if (!(rec = reserve(r)))
+        return;
+    va_start(ap, fmt);
+    vsnprintf(rec->text, ALOG_TEXT_MAX, fmt, ap);
+    va_end(ap);
+    rec->status = 0;
+    publish(r, rec);
+}
+
+/*
+ * alog_writer - drain all rings every ALOG_FLUSH_MS. Lines are
+ *     "<epoch>.<ms> <status> <bytes> <usec>us HIT|MISS|PEER <method> <uri>"
+ *     for requests and "<epoch>.<ms> - <message>" otherwise
+ */
+static void *alog_writer(void *vargp)
+{
+    struct timespec nap = { 0, ALOG_FLUSH_MS * 1000000L };
+    unsigned long dropped;
+    alog_ring_t *r;
+    alog_rec_t *rec;
+    unsigned head, tail;
+    int wrote;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        wrote = 0;
+        for (r = atomic_load(&alog_rings); r; r = r->next) {
+            tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            head = atomic_load_explicit(&r->head, memory_order_acquire);
+            for (; tail != head; tail++, wrote++) {
+                rec = &r->recs[tail % ALOG_RING_SLOTS];
+                if (rec->status)
+                    fprintf(alog_fp, "%lld.%03lld %d %lld %lldus %s %s\n",
+                            rec->ms / 1000, rec->ms % 1000, rec->status, rec->bytes,
+                            rec->usec, hit_names[rec->hit], rec->text);
+                else
+                    fprintf(alog_fp, "%lld.%03lld - %s\n",
+                            rec->ms / 1000, rec->ms % 1000, rec->text);
+            }
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+            if ((dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed))) {
+                fprintf(alog_fp, "- - alog: %lu records dropped\n", dropped);
+                wrote++;
+            }
+        }
+        if (wrote)
+            fflush(alog_fp);
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
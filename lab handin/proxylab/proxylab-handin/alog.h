@@ -0,0 +1,27 @@
+/*
+ * alog.h - asynchronous access log
+ *
+ * Request threads append fixed-size records to their own lock-free
+ * single-producer/single-consumer ring; a background writer thread
+ * drains every ring into the log file. Logging never blocks a request:
+ * when a ring is full the record is dropped and counted instead.
+ * A process that never calls alog_init() writes its messages to stderr.
+ */
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#define ALOG_RING_SLOTS 1024   /* Records buffered per thread (power of 2) */
+#define ALOG_TEXT_MAX 240      /* "METHOD URI" or message text per record */
+#define ALOG_FLUSH_MS 50       /* Writer wakeup interval */
+
+/* Where a response came from */
+#define ALOG_MISS 0            /* The origin */
+#define ALOG_HIT 1             /* Our cache */
+#define ALOG_PEER 2            /* The peer proxy that owns the URI */
+
+void alog_init(const char *path, int sample_every, int rate_per_sec);
+void alog_request(const char *method, const char *uri, int status,
+                  long long bytes, int hit, long long usec);
+void alog_msg(const char *fmt, ...);
+
+#endif /* __ALOG_H__ */
@@ -0,0 +1,150 @@
+#!/usr/bin/python3
+
+# body-test.py - Checks that the proxy relays request bodies and stays in
+#                step with pipelined requests. It runs an origin that
+#                echoes what it is sent, starts ./proxy, and sends on one
+#                keep-alive connection a POST with a body immediately
+#                followed by a GET: the POST must reach the origin with its
+#                body, and the GET must come back as the second response.
+#                A chunked POST, which cannot be relayed, must get 411.
+#                Only GETs are cached: a HEAD must get no body whether or
+#                not the object is cached, must not leave a cached object
+#                without one, and a POST's response must not be cached.
+#
+# usage: body-test.py
+#
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+TIMEOUT_S = 5
+
+def read_request(rfile):
+  """Request line, headers and body from the origin's side of a connection."""
+  line = rfile.readline()
+  headers = {}
+  while True:
+    h = rfile.readline()
+    if h in (b'\r\n', b'\n', b''):
+      break
+    name, _, value = h.decode().partition(':')
+    headers[name.strip().lower()] = value.strip()
+  body = rfile.read(int(headers.get('content-length', 0)))
+  return line, body
+
+def origin(sock):
+  """Answers each request with its request line and body, then closes.
+  A HEAD gets the headers a GET would."""
+  while True:
+    channel, _ = sock.accept()
+    with channel, channel.makefile('rb') as rfile:
+      line, body = read_request(rfile)
+      reply = line.replace(b'HEAD ', b'GET ', 1) + body
+      header = b'HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n' % len(reply)
+      channel.sendall(header if line.startswith(b'HEAD ') else header + reply)
+
+def read_response(rfile, head=False):
+  """Status line and body of one response, framed by its Content-Length.
+  The response to a HEAD has no body."""
+  status = rfile.readline()
+  length = 0
+  while True:
+    h = rfile.readline()
+    if h in (b'\r\n', b'\n', b''):
+      break
+    if h.lower().startswith(b'content-length:'):
+      length = int(h.split(b':')[1])
+  return status, b'' if head else rfile.read(length)
+
+def free_port():
+  s = socket.socket()
+  s.bind(('localhost', 0))
+  port = s.getsockname()[1]
+  s.close()
+  return port
+
+def check(name, ok):
+  global passed, total
+  print('%s: %s' % (name, 'Success' if ok else 'Failure'))
+  passed += ok
+  total += 1
+
+listener = socket.socket()
+listener.bind(('localhost', 0))
+listener.listen(5)
+origin_port = listener.getsockname()[1]
+threading.Thread(target=origin, args=(listener,), daemon=True).start()
+
+proxy_port = free_port()
+proxy = subprocess.Popen(['./proxy', str(proxy_port)],
+                         stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+for _ in range(50):
+  try:
+    socket.create_connection(('localhost', proxy_port)).close()
+    break
+  except OSError:
+    time.sleep(0.1)
+
+passed = total = 0
+try:
+  url = 'http://localhost:%d' % origin_port
+  body = b'x=1&y=' + b'z' * 20000
+  c = socket.create_connection(('localhost', proxy_port), timeout=TIMEOUT_S)
+  c.sendall(b'POST %s/form HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n'
+            % (url.encode(), len(body)) + body +
+            b'GET %s/next HTTP/1.1\r\nHost: localhost\r\n\r\n' % url.encode())
+  rfile = c.makefile('rb')
+  status, reply = read_response(rfile)
+  check('POST body relayed', b' 200 ' in status and
+        reply == b'POST /form HTTP/1.0\r\n' + body)
+  status, reply = read_response(rfile)
+  check('pipelined GET after POST', b' 200 ' in status and
+        reply == b'GET /next HTTP/1.0\r\n')
+  c.close()
+
+  c = socket.create_connection(('localhost', proxy_port), timeout=TIMEOUT_S)
+  c.sendall(b'POST %s/form HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n'
+            b'3\r\nabc\r\n0\r\n\r\n' % url.encode())
+  status, _ = read_response(c.makefile('rb'))
+  check('chunked POST refused', b' 411 ' in status)
+  c.close()
+
+  # HEAD on a miss, then GETs of the same object: the GETs need the body.
+  c = socket.create_connection(('localhost', proxy_port), timeout=TIMEOUT_S)
+  c.sendall(b'HEAD %s/obj HTTP/1.1\r\nHost: localhost\r\n\r\n' % url.encode() +
+            b'GET %s/obj HTTP/1.1\r\nHost: localhost\r\n\r\n' % url.encode() * 2)
+  rfile = c.makefile('rb')
+  status, reply = read_response(rfile, head=True)
+  check('HEAD on a miss', b' 200 ' in status)
+  status, reply = read_response(rfile)
+  check('pipelined GET after HEAD', b' 200 ' in status and
+        reply == b'GET /obj HTTP/1.0\r\n')
+  status, reply = read_response(rfile)
+  check('GET after HEAD, from the cache', b' 200 ' in status and
+        reply == b'GET /obj HTTP/1.0\r\n')
+
+  # A HEAD of the now cached object must not get its body.
+  c.sendall(b'HEAD %s/obj HTTP/1.1\r\nHost: localhost\r\n\r\n' % url.encode() +
+            b'GET %s/next HTTP/1.1\r\nHost: localhost\r\n\r\n' % url.encode())
+  status, reply = read_response(rfile, head=True)
+  check('HEAD on a hit', b' 200 ' in status)
+  status, reply = read_response(rfile)
+  check('pipelined GET after HEAD on a hit', reply == b'GET /next HTTP/1.0\r\n')
+
+  # A POST's response must not answer a later GET of the same URI.
+  c.sendall(b'POST %s/post HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n'
+            % url.encode() + b'GET %s/post HTTP/1.1\r\nHost: localhost\r\n\r\n' % url.encode())
+  status, reply = read_response(rfile)
+  check('POST without a body', reply == b'POST /post HTTP/1.0\r\n')
+  status, reply = read_response(rfile)
+  check('GET after POST not served from the cache', reply == b'GET /post HTTP/1.0\r\n')
+  c.close()
+except OSError as e:
+  print('Failure: %s' % e)
+finally:
+  proxy.kill()
+
+print('bodyScore: %d/%d' % (passed, total))
+sys.exit(0 if total and passed == total else 1)
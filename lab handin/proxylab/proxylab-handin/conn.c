@@ -0,0 +1,648 @@
+/*
+ * conn.c - client connections, buffered output and the parking loop
+ *    (see conn.h)
+ */
+#include "csapp.h"
+#include "conn.h"
+#include "deadline.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+static _Atomic(conn_t *) *conns;   /* By descriptor */
+static int max_conns;
+static _Atomic int live;           /* Connections not yet closed */
+static _Atomic int backlogged;     /* Requests waiting for room on the work queue */
+static sbuf_t *work_queue;         /* Where connections with a request go */
+static int body_idle, keepalive_idle, header_idle;
+static int epfd, wake_pipe[2];
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static conn_t *handoff;            /* Parked by workers, not yet seen by the loop */
+
+/* Loop thread only */
+static conn_t *wheel[WHEEL_SLOTS];
+static long long wheel_tick;       /* Last tick whose slot was expired */
+static conn_t *backlog;            /* Readable, but the work queue was full */
+static int parked;
+
+static void *conn_loop(void *vargp);
+
+/* Request head scanner state */
+#define HEAD_LINE 1                /* The request line has begun */
+#define HEAD_TEXT 2                /* The current line is not blank */
+#define HEAD_CR 4                  /* The current line is just "\r" so far */
+
+/* Create the connection table and start the loop thread */
+void conn_init(sbuf_t *queue, int body_idle_ms, int keepalive_ms, int header_ms)
+{
+    struct epoll_event ev = { EPOLLIN, { NULL } };
+    pthread_t tid;
+
+    max_conns = sysconf(_SC_OPEN_MAX);
+    conns = Calloc(max_conns, sizeof(*conns));
+    work_queue = queue;
+    body_idle = body_idle_ms;
+    keepalive_idle = keepalive_ms;
+    header_idle = header_ms;
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || pipe(wake_pipe) < 0)
+        unix_error("conn_init error");
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_pipe[0], &ev); /* data.ptr NULL: the wake pipe */
+    Pthread_create(&tid, NULL, conn_loop, NULL);
+}
+
+/*
+ * conn_get - the connection on fd, created on its first request. Whoever
+ *    took fd off the work queue owns it until it is parked or closed
+ */
+conn_t *conn_get(int fd)
+{
+    conn_t *c;
+
+    if ((c = atomic_load_explicit(&conns[fd], memory_order_acquire)) != NULL)
+        return c;
+    c = Calloc(1, sizeof(conn_t));
+    c->fd = fd;
+    c->origin_fd = -1;
+    rio_readinitb(&c->rio, fd);
+    atomic_fetch_add(&live, 1);
+    atomic_store_explicit(&conns[fd], c, memory_order_release);
+    return c;
+}
+
+/* conn_accept - give a new connection to the loop until it sends a request */
+void conn_accept(int fd)
+{
+    conn_park(conn_get(fd), 1);
+}
+
+/* Connections open, parked ones included */
+int conn_count(void)
+{
+    return atomic_load(&live);
+}
+
+/* Connections with a whole request that the work queue had no room for */
+int conn_backlogged(void)
+{
+    return atomic_load(&backlogged);
+}
+
+/*
+ * head_scan - continue scanning c's buffered input for the end of a
+ *    request head: a blank line after the request line. Blank lines
+ *    before the request line are skipped, as doit() does. Returns 1 once
+ *    it is found; bytes already scanned are not looked at again
+ */
+static int head_scan(conn_t *c)
+{
+    rio_t *rp = &c->rio;
+    char *p;
+    int s = c->scan_state;
+
+    for (; c->scan_off < (size_t)rp->rio_cnt; c->scan_off++) {
+        p = rp->rio_bufptr + c->scan_off;
+        if (p >= rp->rio_buf + rp->rio_size)
+            p -= rp->rio_size;
+        if (*p == '\n') {
+            if (!(s & HEAD_TEXT) && (s & HEAD_LINE)) {
+                c->scan_off++;
+                c->scan_state = s;
+                return 1;
+            }
+            s &= ~(HEAD_TEXT | HEAD_CR);
+        } else if (*p == '\r' && !(s & (HEAD_TEXT | HEAD_CR)))
+            s |= HEAD_CR;
+        else
+            s = (s & ~HEAD_CR) | HEAD_TEXT | HEAD_LINE;
+    }
+    c->scan_state = s;
+    return 0;
+}
+
+/* conn_head_ready - is a whole request head already buffered on c? */
+int conn_head_ready(conn_t *c)
+{
+    c->scan_off = 0;
+    c->scan_state = 0;
+    return head_scan(c);
+}
+
+size_t conn_pending(conn_t *c)
+{
+    return c->out_len - c->out_off + c->seg_len;
+}
+
+/* Is the output buffer at its cap? */
+int conn_full(conn_t *c)
+{
+    return c->out_len - c->out_off >= CONN_BUF_MAX;
+}
+
+/* Make room for n more bytes at the end of the output buffer */
+static void reserve(conn_t *c, size_t n)
+{
+    size_t size;
+
+    if (c->out_size - c->out_len >= n)
+        return;
+    if (c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+        if (c->out_size - c->out_len >= n)
+            return;
+    }
+    for (size = c->out_size ? c->out_size : 4096; size - c->out_len < n; size *= 2)
+        ;
+    c->out = Realloc(c->out, size);
+    c->out_size = size;
+}
+
+static void append(conn_t *c, const void *buf, size_t n)
+{
+    reserve(c, n);
+    memcpy(c->out + c->out_len, buf, n);
+    c->out_len += n;
+}
+
+static void release_seg(conn_t *c)
+{
+    if (c->seg_ref)
+        c->seg_unref(c->seg_ref);
+    c->seg = NULL;
+    c->seg_len = 0;
+    c->seg_ref = NULL;
+}
+
+/* Drop everything not yet sent */
+static void drop(conn_t *c)
+{
+    c->out_off = c->out_len = 0;
+    release_seg(c);
+}
+
+/* Write what fits of buf; returns the bytes taken, or -1 on error */
+static ssize_t try_write(int fd, const char *buf, size_t n)
+{
+    ssize_t w;
+    size_t done = 0;
+
+    while (done < n) {
+        if ((w = write(fd, buf + done, n - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        done += w;
+    }
+    return done;
+}
+
+/*
+ * flush - send pending output until the socket would block. Returns -1
+ *    and marks the client dead if it failed, otherwise the bytes sent
+ */
+static ssize_t flush(conn_t *c)
+{
+    ssize_t w, sent = 0;
+
+    if (c->out_len > c->out_off) {
+        if ((w = try_write(c->fd, c->out + c->out_off, c->out_len - c->out_off)) < 0)
+            goto dead;
+        c->out_off += w;
+        sent += w;
+        if (c->out_off < c->out_len)
+            return sent;
+    }
+    c->out_off = c->out_len = 0;
+    if (c->seg_len > 0) {
+        if ((w = try_write(c->fd, c->seg, c->seg_len)) < 0)
+            goto dead;
+        c->seg += w;
+        c->seg_len -= w;
+        sent += w;
+        if (c->seg_len == 0)
+            release_seg(c);
+    }
+    return sent;
+
+ dead:
+    c->dead = 1;
+    drop(c);
+    return -1;
+}
+
+/*
+ * conn_write - send n bytes to the client without blocking, buffering
+ *    what the socket does not take. Returns -1 if the client is gone
+ */
+int conn_write(conn_t *c, const void *buf, size_t n)
+{
+    ssize_t w = 0;
+
+    if (c->dead)
+        return -1;
+    if (c->seg_len > 0) {       /* Keep the order: the segment goes first */
+        append(c, c->seg, c->seg_len);
+        release_seg(c);
+    }
+    if (c->out_len == c->out_off && (w = try_write(c->fd, buf, n)) < 0) {
+        c->dead = 1;
+        drop(c);
+        return -1;
+    }
+    if ((size_t)w < n)
+        append(c, (const char *)buf + w, n - w);
+    return flush(c) < 0 ? -1 : 0;
+}
+
+/*
+ * conn_write_ref - conn_write() for bytes owned by a reference-counted
+ *    object: what the socket does not take is sent later straight from
+ *    buf rather than copied. Consumes one reference to ref either way
+ */
+int conn_write_ref(conn_t *c, const char *buf, size_t n, void *ref, void (*unref)(void *))
+{
+    ssize_t w;
+
+    if (c->dead) {
+        unref(ref);
+        return -1;
+    }
+    if (conn_pending(c) > 0) {
+        if (c->seg_len > 0) {   /* Only one segment: copy this one */
+            w = conn_write(c, buf, n);
+            unref(ref);
+            return w;
+        }
+        c->seg = buf;           /* Queue it behind the buffered bytes */
+        c->seg_len = n;
+        c->seg_ref = ref;
+        c->seg_unref = unref;
+        return flush(c) < 0 ? -1 : 0;
+    }
+    if ((w = try_write(c->fd, buf, n)) < 0)
+        c->dead = 1;
+    if (w < 0 || (size_t)w == n) {
+        unref(ref);
+        return w < 0 ? -1 : 0;
+    }
+    c->seg = buf + w;
+    c->seg_len = n - w;
+    c->seg_ref = ref;
+    c->seg_unref = unref;
+    return 0;
+}
+
+/* conn_close - drop pending output, close the socket and free c */
+void conn_close(conn_t *c)
+{
+    drop(c);
+    rio_freeb(&c->rio);
+    atomic_store_explicit(&conns[c->fd], NULL, memory_order_release);
+    close(c->fd);
+    free(c->out);
+    free(c);
+    atomic_fetch_sub(&live, 1);
+}
+
+static void hand_off(conn_t *c)
+{
+    int was_empty;
+
+    pthread_mutex_lock(&handoff_lock);
+    was_empty = handoff == NULL;
+    c->qnext = handoff;
+    handoff = c;
+    pthread_mutex_unlock(&handoff_lock);
+    if (was_empty)
+        (void)!write(wake_pipe[1], "", 1);
+}
+
+/*
+ * conn_park - give c to the loop thread, which sends its pending output
+ *    and then closes it or, if keepalive, waits for its next request and
+ *    puts it back on the work queue. The caller must not touch c again
+ */
+void conn_park(conn_t *c, int keepalive)
+{
+    if (c->dead || (!keepalive && conn_pending(c) == 0)) {
+        conn_close(c);
+        return;
+    }
+    c->keepalive = keepalive;
+    c->origin_fd = -1;
+    hand_off(c);
+}
+
+/*
+ * conn_park_relay - conn_park(), after the loop has relayed the rest of a
+ *    response from origin_fd: remaining bytes, or up to EOF if -1. The
+ *    origin is only read while c's buffer is under CONN_BUF_MAX, so a slow
+ *    client slows the origin down rather than filling memory. done(c, ok)
+ *    is called on the loop thread once the origin is finished with, ok
+ *    being 0 if it failed; origin_fd is closed after that
+ */
+void conn_park_relay(conn_t *c, int origin_fd, long long remaining, int keepalive,
+                     void (*done)(conn_t *, int ok), void *ctx)
+{
+    c->relayed = 0;
+    if (c->dead) {
+        done(c, 1);
+        close(origin_fd);
+        conn_close(c);
+        return;
+    }
+    c->keepalive = keepalive;
+    c->origin_fd = origin_fd;
+    c->remaining = remaining;
+    c->done = done;
+    c->ctx = ctx;
+    hand_off(c);
+}
+
+/*
+ * Everything below runs on the loop thread. The loop holds parked
+ * connections in a level-triggered epoll set and a hashed timer wheel.
+ * Deadlines only move forward on progress, so the wheel is updated
+ * lazily: an entry whose slot comes up early is re-filed, not expired.
+ */
+
+/* Change the events watched on fd; 0 takes it out of the set */
+static void watch(int fd, int *cur, int want, void *ptr)
+{
+    struct epoll_event ev;
+
+    if (want == *cur)
+        return;
+    ev.events = want;
+    ev.data.ptr = ptr;
+    epoll_ctl(epfd, !*cur ? EPOLL_CTL_ADD : !want ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &ev);
+    *cur = want;
+}
+
+static void wheel_add(conn_t *c)
+{
+    long long tick = c->deadline / WHEEL_TICK_MS;
+    conn_t **slot;
+
+    if (tick <= wheel_tick)
+        tick = wheel_tick + 1;
+    slot = &wheel[tick % WHEEL_SLOTS];
+    if ((c->wnext = *slot) != NULL)
+        c->wnext->wpprev = &c->wnext;
+    c->wpprev = slot;
+    *slot = c;
+}
+
+static void wheel_del(conn_t *c)
+{
+    if (!c->wpprev)
+        return;
+    if ((*c->wpprev = c->wnext) != NULL)
+        c->wnext->wpprev = c->wpprev;
+    c->wpprev = NULL;
+}
+
+static void set_deadline(conn_t *c, long long deadline)
+{
+    int earlier = deadline < c->deadline;
+
+    c->deadline = deadline;
+    if (earlier) {              /* Lazy re-filing only works forwards */
+        wheel_del(c);
+        wheel_add(c);
+    }
+}
+
+/* The origin is finished with: report it and close it */
+static void end_relay(conn_t *c, int ok)
+{
+    watch(c->origin_fd, &c->oev, 0, NULL);
+    close(c->origin_fd);
+    c->origin_fd = -1;
+    c->done(c, ok);
+}
+
+/* Close a parked connection */
+static void retire(conn_t *c)
+{
+    wheel_del(c);
+    watch(c->fd, &c->cev, 0, NULL);
+    if (c->origin_fd >= 0)
+        end_relay(c, 0);
+    parked--;
+    conn_close(c);
+}
+
+/* Return c to the workers; it leaves the loop's hands */
+static void requeue(conn_t *c)
+{
+    wheel_del(c);
+    watch(c->fd, &c->cev, 0, NULL);
+    c->idle = 0;
+    parked--;
+    if (!sbuf_tryinsert(work_queue, c->fd)) {
+        c->qnext = backlog;
+        backlog = c;
+        atomic_fetch_add(&backlogged, 1);
+    }
+}
+
+/*
+ * wait_head - requeue c if a whole request head is buffered, otherwise
+ *    wait for the rest: keepalive_idle for it to begin, then header_idle
+ */
+static void wait_head(conn_t *c)
+{
+    if (head_scan(c)) {
+        requeue(c);
+        return;
+    }
+    if (!c->idle) {
+        c->idle = 1;
+        watch(c->fd, &c->cev, EPOLLIN, c);
+        set_deadline(c, dl_now() + (c->rio.rio_cnt > 0 ? header_idle : keepalive_idle));
+    }
+}
+
+/* read_head - take in what an idle connection has sent */
+static void read_head(conn_t *c)
+{
+    int empty = c->rio.rio_cnt == 0;
+    ssize_t n;
+
+    if ((n = rio_fillb(&c->rio)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n < 0 && errno == ENOBUFS) {
+        requeue(c);                 /* Too long to buffer: doit() refuses it */
+        return;
+    }
+    if (n <= 0) {
+        retire(c);
+        return;
+    }
+    if (empty)                      /* The request has begun: header_idle from now */
+        c->deadline = dl_now() + header_idle;
+    wait_head(c);
+}
+
+/*
+ * step - move c along as far as it goes without blocking: send its
+ *    output, refill it from the origin while under the cap, and then
+ *    either finish with it or watch for what it needs next
+ */
+static void step(conn_t *c)
+{
+    ssize_t n;
+    size_t want;
+    int moved = 0;
+
+    while (1) {
+        if ((n = flush(c)) < 0) {
+            if (c->origin_fd >= 0)
+                end_relay(c, 1);    /* Not the origin's fault */
+            retire(c);
+            return;
+        }
+        moved |= n > 0;
+        if (c->origin_fd < 0 || c->out_len - c->out_off >= CONN_BUF_MAX)
+            break;
+        if (c->remaining == 0) {
+            end_relay(c, 1);
+            break;
+        }
+        want = CONN_BUF_MAX - (c->out_len - c->out_off);
+        if (want > CONN_CHUNK)
+            want = CONN_CHUNK;
+        if (c->remaining > 0 && (long long)want > c->remaining)
+            want = c->remaining;
+        reserve(c, want);
+        if ((n = read(c->origin_fd, c->out + c->out_len, want)) > 0) {
+            c->out_len += n;
+            c->relayed += n;
+            if (c->remaining > 0)
+                c->remaining -= n;
+            moved = 1;
+        } else if (n == 0 && c->remaining < 0) {
+            end_relay(c, 1);        /* Body ends at EOF */
+            break;
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            c->keepalive = 0;       /* Truncated: send what came, then close */
+            end_relay(c, 0);
+            break;
+        } else if (errno != EINTR)
+            break;
+    }
+
+    if (conn_pending(c) == 0 && c->origin_fd < 0) {
+        if (!c->keepalive)
+            retire(c);
+        else {
+            c->scan_off = 0;        /* The worker may have consumed input */
+            c->scan_state = 0;
+            wait_head(c);
+        }
+        return;
+    }
+    watch(c->fd, &c->cev, conn_pending(c) > 0 ? EPOLLOUT : 0, c);
+    if (c->origin_fd >= 0)
+        watch(c->origin_fd, &c->oev, conn_full(c) ? 0 : EPOLLIN, (void *)((uintptr_t)c | 1));
+    if (moved)
+        c->deadline = dl_now() + body_idle;
+}
+
+/* Take in connections parked since the last wakeup */
+static void adopt(void)
+{
+    char buf[64];
+    conn_t *c, *next;
+
+    while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    pthread_mutex_lock(&handoff_lock);
+    c = handoff;
+    handoff = NULL;
+    pthread_mutex_unlock(&handoff_lock);
+    for (; c; c = next) {
+        next = c->qnext;
+        parked++;
+        c->idle = 0;
+        c->cev = c->oev = 0;
+        c->deadline = dl_now() + body_idle;
+        wheel_add(c);
+        step(c);
+    }
+}
+
+/* Close connections whose deadline has passed; re-file the rest */
+static void expire(long long now)
+{
+    long long tick, last = now / WHEEL_TICK_MS;
+    conn_t *c, *next;
+
+    if (last - wheel_tick > WHEEL_SLOTS)
+        wheel_tick = last - WHEEL_SLOTS;
+    while (wheel_tick < last) {
+        tick = ++wheel_tick;
+        c = wheel[tick % WHEEL_SLOTS];
+        wheel[tick % WHEEL_SLOTS] = NULL;
+        for (; c; c = next) {
+            next = c->wnext;
+            c->wpprev = NULL;
+            if (c->deadline > now) {
+                wheel_add(c);
+                continue;
+            }
+            if (c->origin_fd >= 0)  /* Blame whichever side we were waiting on */
+                end_relay(c, conn_pending(c) > 0);
+            retire(c);
+        }
+    }
+}
+
+static void *conn_loop(void *vargp)
+{
+    struct epoll_event evs[CONN_EVENTS];
+    conn_t *c, *ready[CONN_EVENTS];
+    int i, n, nready;
+
+    Pthread_detach(pthread_self());
+    wheel_tick = dl_now() / WHEEL_TICK_MS;
+    while (1) {
+        n = epoll_wait(epfd, evs, CONN_EVENTS, parked || backlog ? WHEEL_TICK_MS : -1);
+        /* A relay can report both its sockets at once: step it only once,
+           as the first step may already have closed or requeued it */
+        for (i = nready = 0; i < n; i++) {
+            if (evs[i].data.ptr == NULL) {
+                adopt();
+                continue;
+            }
+            c = (conn_t *)((uintptr_t)evs[i].data.ptr & ~(uintptr_t)1);
+            if (!c->ready) {
+                c->ready = 1;
+                ready[nready++] = c;
+            }
+        }
+        for (i = 0; i < nready; i++) {
+            c = ready[i];
+            c->ready = 0;
+            if (c->idle)
+                read_head(c);
+            else
+                step(c);
+        }
+        while (backlog && sbuf_tryinsert(work_queue, backlog->fd)) {
+            backlog = backlog->qnext;
+            atomic_fetch_sub(&backlogged, 1);
+        }
+        expire(dl_now());
+    }
+    return NULL;
+}
@@ -0,0 +1,73 @@
+/*
+ * conn.h - client connections, buffered output and the parking loop
+ *
+ * Workers never wait on a slow client. Output goes out with non-blocking
+ * writes; what the socket will not take is kept in the connection's own
+ * buffer (or, for cached objects, as a reference to the object). When a
+ * worker is done with a request it parks the connection: a single epoll
+ * thread then finishes sending the response, waits for the next request
+ * on a persistent connection, or keeps relaying a large response from
+ * the origin, reading from it only while the buffer is below
+ * CONN_BUF_MAX. Idle timeouts are kept on a hashed timer wheel.
+ *
+ * New connections start out parked too. The loop reads a request into
+ * the connection's rio buffer and only puts the connection on the work
+ * queue once the whole request head, up to its blank line, is there, so
+ * a worker never waits for a client to send one.
+ */
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+#define CONN_BUF_MAX (256 * 1024) /* Buffered output before the origin is throttled */
+#define WHEEL_SLOTS 512
+#define WHEEL_TICK_MS 20          /* Timer resolution; one turn is ~10s */
+#define CONN_CHUNK (64 * 1024)    /* Largest single read from a relayed origin */
+#define CONN_EVENTS 64            /* epoll events handled per wakeup */
+
+typedef struct conn {
+    int fd;
+    rio_t rio;                    /* Client input, pipelined requests included */
+    int dead;                     /* The client failed a write */
+    char *out;                    /* Unsent bytes are out[out_off..out_len) */
+    size_t out_off, out_len, out_size;
+    const char *seg;              /* Then seg[0..seg_len), owned by seg_ref */
+    size_t seg_len;
+    void *seg_ref;
+    void (*seg_unref)(void *);
+
+    /* Parked state, owned by the loop thread */
+    int keepalive;                /* Wait for another request once flushed */
+    int idle;                     /* Waiting for that request */
+    int origin_fd;                /* Relaying from here, -1 if not */
+    long long remaining;          /* Origin bytes still to relay, -1 until EOF */
+    long long relayed;            /* Origin bytes relayed by the loop */
+    void (*done)(struct conn *, int ok); /* Called when the relay ends */
+    void *ctx;                    /* For done() */
+    long long deadline;           /* CLOCK_MONOTONIC ms */
+    int cev, oev;                 /* epoll events watched on fd and origin_fd */
+    int ready;                    /* Reported by the current epoll_wait() */
+    struct conn *wnext, **wpprev; /* Timer wheel slot list; wpprev NULL if off it */
+    struct conn *qnext;           /* Hand-off and requeue lists */
+    size_t scan_off;              /* Request head bytes scanned so far */
+    int scan_state;               /* Where that scan stopped (HEAD_* flags) */
+} conn_t;
+
+void conn_init(sbuf_t *queue, int body_idle_ms, int keepalive_ms, int header_ms);
+conn_t *conn_get(int fd);
+void conn_accept(int fd);
+int conn_count(void);
+int conn_backlogged(void);
+int conn_head_ready(conn_t *c);
+int conn_write(conn_t *c, const void *buf, size_t n);
+int conn_write_ref(conn_t *c, const char *buf, size_t n, void *ref, void (*unref)(void *));
+size_t conn_pending(conn_t *c);
+int conn_full(conn_t *c);
+void conn_close(conn_t *c);
+void conn_park(conn_t *c, int keepalive);
+void conn_park_relay(conn_t *c, int origin_fd, long long remaining, int keepalive,
+                     void (*done)(conn_t *, int ok), void *ctx);
+
+#endif /* __CONN_H__ */
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -42,12 +43,15 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 16384           /* Initial (inline) buffer size */
+#define RIO_MAXBUFSIZE (1 << 20)    /* Growth limit for very long lines */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal ring buffer */
+    size_t rio_size;           /* Capacity of rio_buf */
+    char rio_inline[RIO_BUFSIZE]; /* Storage used until the buffer grows */
 } rio_t;
 /* $end rio_t */
 
@@ -178,6 +182,11 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_fillb(rio_t *rp);
+ssize_t rio_peek(rio_t *rp, char **bufp);
+ssize_t rio_peekline(rio_t *rp, char **linep);
+void rio_consume(rio_t *rp, size_t n);
+void rio_freeb(rio_t *rp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
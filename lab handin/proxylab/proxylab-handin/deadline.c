@@ -0,0 +1,92 @@
+/*
+ * deadline.c - socket I/O bounded by absolute deadlines (see deadline.h)
+ */
+#include "deadline.h"
+#include <poll.h>
+#include <time.h>
+
+long long dl_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* dl_after - the deadline ms from now, but never later than limit */
+long long dl_after(int ms, long long limit)
+{
+    long long d = dl_now() + ms;
+
+    return d < limit ? d : limit;
+}
+
+/*
+ * dl_wait - wait until fd is ready for events. Returns 0 when it is (or
+ *    has an error or hangup pending for the next call to report), -1 with
+ *    errno ETIMEDOUT when the deadline passes first
+ */
+int dl_wait(int fd, short events, long long deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    long long left;
+    int rc;
+
+    while ((left = deadline - dl_now()) > 0) {
+        if ((rc = poll(&pfd, 1, left)) > 0)
+            return 0;
+        if (rc < 0 && errno != EINTR)
+            return -1;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/* dl_readlineb - rio_readlineb() that waits for a complete line */
+ssize_t dl_readlineb(rio_t *rp, void *usrbuf, size_t maxlen, long long deadline)
+{
+    ssize_t n;
+
+    /* A partial line stays buffered across EAGAIN, so retrying is safe */
+    while ((n = rio_readlineb(rp, usrbuf, maxlen)) < 0) {
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+            dl_wait(rp->rio_fd, POLLIN, deadline) < 0)
+            return -1;
+    }
+    return n;
+}
+
+/* dl_peek - rio_peek() that waits for data */
+ssize_t dl_peek(rio_t *rp, char **bufp, long long deadline)
+{
+    ssize_t n;
+
+    while ((n = rio_peek(rp, bufp)) < 0) {
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+            dl_wait(rp->rio_fd, POLLIN, deadline) < 0)
+            return -1;
+    }
+    return n;
+}
+
+/* dl_writen - write all n bytes. Returns n, or -1 on error or timeout */
+ssize_t dl_writen(int fd, const void *usrbuf, size_t n, long long deadline)
+{
+    size_t nleft = n;
+    ssize_t nwritten;
+    const char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if ((nwritten = write(fd, bufp, nleft)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+                dl_wait(fd, POLLOUT, deadline) < 0)
+                return -1;
+            continue;
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    return n;
+}
@@ -0,0 +1,21 @@
+/*
+ * deadline.h - socket I/O bounded by absolute deadlines
+ *
+ * Deadlines are CLOCK_MONOTONIC milliseconds. Descriptors are expected to
+ * be non-blocking: each call retries on EAGAIN after poll()ing for at
+ * most the time left, and fails with errno ETIMEDOUT once it is gone.
+ * Nothing here exits the process; all errors are returned to the caller.
+ */
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include "csapp.h"
+
+long long dl_now(void);
+long long dl_after(int ms, long long limit);
+int dl_wait(int fd, short events, long long deadline);
+ssize_t dl_readlineb(rio_t *rp, void *usrbuf, size_t maxlen, long long deadline);
+ssize_t dl_peek(rio_t *rp, char **bufp, long long deadline);
+ssize_t dl_writen(int fd, const void *usrbuf, size_t n, long long deadline);
+
+#endif /* __DEADLINE_H__ */
@@ -0,0 +1,451 @@
+/*
+ * filter.c - request/response filter pipeline (see filter.h)
+ */
+#include "csapp.h"
+#include "filter.h"
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * Perfect hash over a fixed key set: keys are placed by a seeded,
+ * case-insensitive hash into a power-of-two slot array, and seeds (then
+ * sizes) are tried until no two keys collide. A lookup is one hash and
+ * one compare against the single key that can be in its slot.
+ */
+typedef struct {
+    int n;
+    char *keys[FILTER_MAX_RULES];
+    size_t lens[FILTER_MAX_RULES];
+    unsigned seed, mask;
+    int *slot;                  /* Key index per slot, -1 if empty */
+} phash_t;
+
+typedef struct {
+    int flags;
+    char *value;                /* For F_ADD */
+} rule_t;
+
+/* One compiled configuration; immutable once published */
+typedef struct rules {
+    phash_t req_tab, resp_tab, deny_tab, rewrite_tab;
+    rule_t req_rules[FILTER_MAX_RULES], resp_rules[FILTER_MAX_RULES];
+    char *rewrite_to[FILTER_MAX_RULES];
+    char req_extra[MAXLINE], resp_extra[MAXLINE]; /* F_ADD headers, in rule order */
+    long long retired_ms;       /* When it was replaced */
+    struct rules *next;         /* Retired sets, newest first */
+} rules_t;
+
+static rules_t *building;       /* Set being filled in by filter_add()/filter_load() */
+static _Atomic(rules_t *) active; /* What requests are filtered with */
+static rules_t *retired;        /* Replaced sets, awaiting FILTER_GRACE_MS */
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* The set being built, started on first use */
+static rules_t *draft(void)
+{
+    if (!building)
+        building = Calloc(1, sizeof(rules_t));
+    return building;
+}
+
+static rules_t *current(void)
+{
+    return atomic_load_explicit(&active, memory_order_acquire);
+}
+
+static unsigned phash_hash(const char *s, size_t len, unsigned seed)
+{
+    unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    while (len--)
+        h = (h ^ (unsigned char)tolower(*s++)) * 16777619u;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    return h ^ (h >> 12);
+}
+
+/*
+ * Index of key in t, adding it if new; names compare case-insensitively.
+ * -1 if t is full
+ */
+static int phash_add(phash_t *t, const char *key)
+{
+    size_t len = strlen(key);
+    int i;
+
+    for (i = 0; i < t->n; i++)
+        if (t->lens[i] == len && !strcasecmp(t->keys[i], key))
+            return i;
+    if (t->n == FILTER_MAX_RULES) {
+        fprintf(stderr, "too many filter rules\n");
+        return -1;
+    }
+    t->keys[t->n] = strdup(key);
+    t->lens[t->n] = len;
+    return t->n++;
+}
+
+static void phash_build(phash_t *t)
+{
+    unsigned size, seed, h;
+    int i;
+
+    for (size = 8; size < 2u * t->n; size *= 2)
+        ;
+    for (;; size *= 2) {
+        t->slot = Realloc(t->slot, size * sizeof(int));
+        t->mask = size - 1;
+        for (seed = 1; seed <= 1000; seed++) {
+            memset(t->slot, -1, size * sizeof(int));
+            for (i = 0; i < t->n; i++) {
+                h = phash_hash(t->keys[i], t->lens[i], seed) & t->mask;
+                if (t->slot[h] >= 0)
+                    break;
+                t->slot[h] = i;
+            }
+            if (i == t->n) {
+                t->seed = seed;
+                return;
+            }
+        }
+    }
+}
+
+static void phash_free(phash_t *t)
+{
+    int i;
+
+    for (i = 0; i < t->n; i++)
+        free(t->keys[i]);
+    free(t->slot);
+}
+
+static int phash_find(phash_t *t, const char *key, size_t len)
+{
+    int i;
+
+    if (t->n == 0)
+        return -1;
+    i = t->slot[phash_hash(key, len, t->seed) & t->mask];
+    if (i < 0 || t->lens[i] != len || strncasecmp(t->keys[i], key, len))
+        return -1;
+    return i;
+}
+
+/*
+ * filter_add - add or override a header rule in the set being built.
+ *    Framing and connection flags a rule already has survive an override,
+ *    so a config file can not break the proxy's own handling of those
+ *    headers. Returns -1 if the table is full
+ */
+int filter_add(int dir, const char *name, int flags, const char *value)
+{
+    rules_t *b = draft();
+    phash_t *t = dir == FILTER_REQUEST ? &b->req_tab : &b->resp_tab;
+    int i = phash_add(t, name);
+    rule_t *r;
+    size_t len;
+
+    if (i < 0)
+        return -1;
+    r = &(dir == FILTER_REQUEST ? b->req_rules : b->resp_rules)[i];
+    r->flags = (r->flags & (F_KEEPALIVE | F_PEER | F_CLEN | F_TENC)) | flags;
+    free(r->value);
+    r->value = NULL;
+    if (value) {
+        r->value = strdup(value);
+        len = strlen(r->value);
+        while (len > 0 && (r->value[len - 1] == '\n' || r->value[len - 1] == '\r'))
+            r->value[--len] = '\0';
+    }
+    return 0;
+}
+
+/*
+ * filter_load - add the rules of a config file to the set being built;
+ *    call before filter_compile(). Returns -1 on an error, which has been
+ *    reported on stderr
+ */
+int filter_load(const char *path)
+{
+    FILE *fp;
+    char line[MAXLINE], directive[16], op[16], name[MAXLINE], to[MAXLINE], *value;
+    int lineno = 0, off, dir;
+    rules_t *b = draft();
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "cannot open filter config %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp)) {
+        lineno++;
+        if (strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%15s", directive) != 1)
+            continue;
+        if (!strcmp(directive, "request") || !strcmp(directive, "response")) {
+            dir = !strcmp(directive, "request") ? FILTER_REQUEST : FILTER_RESPONSE;
+            if (sscanf(line, "%*s %15s %s %n", op, name, &off) < 2)
+                goto bad;
+            value = line + off;
+            if (!strcmp(op, "remove"))
+                off = filter_add(dir, name, F_REMOVE, NULL);
+            else if (!strcmp(op, "set") && *value)
+                off = filter_add(dir, name, F_REMOVE | F_ADD, value);
+            else if (!strcmp(op, "add") && *value)
+                off = filter_add(dir, name, F_ADD, value);
+            else
+                goto bad;
+            if (off < 0)
+                goto bad;
+        } else if (!strcmp(directive, "rewrite")) {
+            if (sscanf(line, "%*s %s %s", name, to) != 2)
+                goto bad;
+            if ((off = phash_add(&b->rewrite_tab, name)) < 0)
+                goto bad;
+            free(b->rewrite_to[off]);
+            b->rewrite_to[off] = strdup(to);
+        } else if (!strcmp(directive, "deny")) {
+            if (sscanf(line, "%*s %s", name) != 1)
+                goto bad;
+            if (phash_add(&b->deny_tab, name) < 0)
+                goto bad;
+        } else
+            goto bad;
+    }
+    fclose(fp);
+    return 0;
+
+ bad:
+    fprintf(stderr, "%s:%d: bad filter directive\n", path, lineno);
+    fclose(fp);
+    return -1;
+}
+
+static int build_extra(phash_t *t, rule_t *rules, char *out)
+{
+    size_t used = 0;
+    int i, n;
+
+    for (i = 0; i < t->n; i++) {
+        if (!(rules[i].flags & F_ADD))
+            continue;
+        n = snprintf(out + used, MAXLINE - used, "%s: %s\r\n", t->keys[i], rules[i].value);
+        if (n < 0 || (size_t)n >= MAXLINE - used) {
+            fprintf(stderr, "filter: added headers exceed %d bytes\n", MAXLINE);
+            return -1;
+        }
+        used += n;
+    }
+    return 0;
+}
+
+static void rules_free(rules_t *r)
+{
+    int i;
+
+    for (i = 0; i < r->req_tab.n; i++)
+        free(r->req_rules[i].value);
+    for (i = 0; i < r->resp_tab.n; i++)
+        free(r->resp_rules[i].value);
+    for (i = 0; i < r->rewrite_tab.n; i++)
+        free(r->rewrite_to[i]);
+    phash_free(&r->req_tab);
+    phash_free(&r->resp_tab);
+    phash_free(&r->deny_tab);
+    phash_free(&r->rewrite_tab);
+    free(r);
+}
+
+/* Throw away the set being built, after a failed filter_load() */
+void filter_abort(void)
+{
+    if (building)
+        rules_free(building);
+    building = NULL;
+}
+
+/*
+ * filter_compile - build the lookup tables of the set being built and
+ *    switch requests over to it. The set it replaces is freed by a later
+ *    call, once FILTER_GRACE_MS have passed: readers are not counted, so
+ *    this relies on the static assertion in proxy.c that every request
+ *    ends within TOTAL_TIMEOUT_MS. Returns -1, keeping the current set,
+ *    if the added headers do not fit
+ */
+int filter_compile(void)
+{
+    rules_t *b = draft(), *old, *next, **pp;
+    long long now = now_ms();
+
+    phash_build(&b->req_tab);
+    phash_build(&b->resp_tab);
+    phash_build(&b->deny_tab);
+    phash_build(&b->rewrite_tab);
+    if (build_extra(&b->req_tab, b->req_rules, b->req_extra) < 0 ||
+        build_extra(&b->resp_tab, b->resp_rules, b->resp_extra) < 0) {
+        filter_abort();
+        return -1;
+    }
+    building = NULL;
+    if ((old = atomic_exchange_explicit(&active, b, memory_order_acq_rel)) != NULL) {
+        old->retired_ms = now;
+        old->next = retired;
+        retired = old;
+    }
+    for (pp = &retired; *pp; pp = &(*pp)->next) {
+        if ((*pp)->retired_ms + FILTER_GRACE_MS <= now) {
+            for (old = *pp, *pp = NULL; old; old = next) { /* The rest are older still */
+                next = old->next;
+                rules_free(old);
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * filter_parse - split a raw header line in place. Returns -1 if it has
+ *    no "name:" part
+ */
+int filter_parse(char *line, size_t len, hdr_t *h)
+{
+    char *colon = memchr(line, ':', len), *end = line + len;
+
+    if (!colon || colon == line)
+        return -1;
+    while (end > colon + 1 && (end[-1] == '\n' || end[-1] == '\r'))
+        end--;
+    h->name = line;
+    h->name_len = colon - line;
+    for (h->value = colon + 1; h->value < end && (*h->value == ' ' || *h->value == '\t'); h->value++)
+        ;
+    h->value_len = end - h->value;
+    return 0;
+}
+
+/* Does the comma-separated list in value contain token? */
+static int has_token(const char *value, size_t len, const char *token)
+{
+    size_t tlen = strlen(token), n;
+    const char *end = value + len, *comma;
+
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ','))
+            value++;
+        comma = memchr(value, ',', end - value);
+        n = (comma ? comma : end) - value;
+        while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t'))
+            n--;
+        if (n == tlen && !strncasecmp(value, token, tlen))
+            return 1;
+        value = comma ? comma + 1 : end;
+    }
+    return 0;
+}
+
+/*
+ * filter_url - apply the deny list and host rewrites to a request for
+ *    host:port, rewriting both in place (they must hold MAXLINE bytes).
+ *    Returns -1 if the host is denied
+ */
+int filter_url(char *host, char *port)
+{
+    rules_t *r = current();
+    char *to, *colon;
+    int i;
+
+    if (phash_find(&r->deny_tab, host, strlen(host)) >= 0)
+        return -1;
+    if ((i = phash_find(&r->rewrite_tab, host, strlen(host))) >= 0) {
+        to = r->rewrite_to[i];
+        if ((colon = strrchr(to, ':')) != NULL) {
+            memcpy(host, to, colon - to);
+            host[colon - to] = '\0';
+            strcpy(port, colon + 1);
+        } else
+            strcpy(host, to);
+    }
+    return 0;
+}
+
+/*
+ * filter_request_headers - run the request rules over hdrs[0..n-1] and
+ *    write the headers to forward into out: the kept ones in their
+ *    original order, then Host and the added ones, then the blank line.
+ *    Connection tokens update *keepalive, the peer marker sets *from_peer.
+ *    *body is set to the Content-Length of the request body, or to -1 if
+ *    its length is not known up front (any Transfer-Encoding but identity)
+ *    or not valid; it is left alone for a request without one.
+ *    Returns -1 if the result does not fit in size bytes
+ */
+int filter_request_headers(hdr_t *hdrs, int n, char *host, char *port, char *out,
+                           size_t size, int *keepalive, int *from_peer, long long *body)
+{
+    rules_t *rs = current();
+    size_t used = 0, len;
+    int i, r, flags, w;
+    hdr_t *h;
+
+    for (i = 0; i < n; i++) {
+        h = &hdrs[i];
+        r = phash_find(&rs->req_tab, h->name, h->name_len);
+        flags = r < 0 ? 0 : rs->req_rules[r].flags;
+        if (flags & F_KEEPALIVE) {
+            if (has_token(h->value, h->value_len, "close"))
+                *keepalive = 0;
+            else if (has_token(h->value, h->value_len, "keep-alive"))
+                *keepalive = 1;
+        }
+        if (flags & F_PEER)
+            *from_peer = 1;
+        if ((flags & F_CLEN) && *body >= 0 && (*body = atoll(h->value)) < 0)
+            *body = -1;
+        if ((flags & F_TENC) && !(h->value_len == 8 && !strncasecmp(h->value, "identity", 8)))
+            *body = -1;
+        if (flags & F_REMOVE)
+            continue;
+        len = h->value + h->value_len - h->name;
+        if (used + len + 2 >= size)
+            return -1;
+        memcpy(out + used, h->name, len);
+        memcpy(out + used + len, "\r\n", 2);
+        used += len + 2;
+    }
+    w = snprintf(out + used, size - used, "Host: %s:%s\r\n%s\r\n", host, port, rs->req_extra);
+    return w < 0 || (size_t)w >= size - used ? -1 : 0;
+}
+
+/*
+ * filter_response - apply the response rules to one header line.
+ *    Returns 0 if it must be dropped. Sets *clen from Content-Length
+ */
+int filter_response(char *line, long long *clen)
+{
+    rules_t *rs = current();
+    hdr_t h;
+    int r, flags;
+
+    if (filter_parse(line, strlen(line), &h) < 0)
+        return 1;
+    r = phash_find(&rs->resp_tab, h.name, h.name_len);
+    flags = r < 0 ? 0 : rs->resp_rules[r].flags;
+    if (flags & F_CLEN)
+        *clen = atoll(h.value);
+    return !(flags & F_REMOVE);
+}
+
+/* Headers the response rules add, ready to send */
+const char *filter_response_extra(void)
+{
+    return current()->resp_extra;
+}
@@ -0,0 +1,63 @@
+/*
+ * filter.h - request/response filter pipeline
+ *
+ * Header rules, host rewrites and the host deny list are compiled once
+ * into perfect-hash tables: finding the rule for a header costs one hash
+ * and at most one name compare, however many rules there are. Requests
+ * are filtered in a single pass over their parsed header vector.
+ *
+ * Config file, one directive per line, '#' starts a comment:
+ *     request remove|set|add <Header> [<value>]
+ *     response remove|set|add <Header> [<value>]
+ *     rewrite <host> <new host>[:<port>]
+ *     deny <host>
+ * "set" replaces any header of that name with the value, "add" keeps
+ * them and adds one more.
+ *
+ * The configuration can be replaced while requests run: a new set of
+ * rules is built with filter_add()/filter_load() and switched to by
+ * filter_compile(). A request may see the old set or the new one, and the
+ * old one is only freed once no request can still be using it.
+ */
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+
+#define FILTER_MAX_RULES 128     /* Per table */
+#define FILTER_MAX_HEADERS 100   /* Request headers kept per request */
+#define FILTER_GRACE_MS 120000   /* Replaced rules are kept this long; proxy.c asserts that
+                                    its TOTAL_TIMEOUT_MS per request is shorter */
+
+/* Rule directions */
+#define FILTER_REQUEST 0
+#define FILTER_RESPONSE 1
+
+/* Rule flags */
+#define F_REMOVE 1      /* Drop the header */
+#define F_ADD 2         /* Emit the rule's value after the kept headers */
+#define F_KEEPALIVE 4   /* Connection tokens decide whether the client persists */
+#define F_PEER 8        /* Marks a request from a cache peer */
+#define F_CLEN 16       /* Content-Length: body framing */
+#define F_TENC 32       /* Transfer-Encoding: a body of no length known up front */
+
+/* One header of a parsed request; both strings point into the raw line */
+typedef struct {
+    char *name;
+    size_t name_len;
+    char *value;
+    size_t value_len;
+} hdr_t;
+
+int filter_add(int dir, const char *name, int flags, const char *value);
+int filter_load(const char *path);
+int filter_compile(void);
+void filter_abort(void);
+int filter_parse(char *line, size_t len, hdr_t *h);
+int filter_url(char *host, char *port);
+int filter_request_headers(hdr_t *hdrs, int n, char *host, char *port, char *out,
+                           size_t size, int *keepalive, int *from_peer, long long *body);
+int filter_response(char *line, long long *clen);
+const char *filter_response_extra(void);
+
+#endif /* __FILTER_H__ */
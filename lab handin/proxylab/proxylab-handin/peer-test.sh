@@ -0,0 +1,144 @@
+#!/bin/bash
+#
+# peer-test.sh - Checks peer mode over loopback. Starts Tiny and two
+#     proxies that name each other as cache peers, then fetches every
+#     file through both of them. Each URI is owned by exactly one proxy,
+#     so for each file exactly one of the two access logs must show it
+#     served as PEER, and the owner must have fetched it itself.
+#
+#     usage: ./peer-test.sh
+#
+
+# Various constants
+HOME_DIR=`pwd`
+PEER_DIR="./.peer"
+TIMEOUT=5
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+MAX_PORT_TRIES=10
+
+# Files fetched through each proxy
+FETCH_LIST="home.html
+            csapp.c
+            tiny.c
+            godzilla.jpg
+            godzilla.gif
+            tiny"
+
+#####
+# Helper functions
+#
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Times out after 10 seconds.
+#
+function wait_for_port_use() {
+    timeout_count="0"
+    while ! netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 | grep -wq "${1}"
+    do
+        timeout_count=`expr ${timeout_count} + 1`
+        if [ "${timeout_count}" == "${MAX_PORT_TRIES}" ]; then
+            kill -ALRM $$
+        fi
+        sleep 1
+    done
+}
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 | grep -wq "${port}"
+    do
+        if [ $port -eq ${PORT_MAX} ]; then
+            echo "-1"
+            return
+        fi
+        port=`expr ${port} + 1`
+    done
+    echo "${port}"
+}
+
+#
+# served_as - counts the records in access log $1 for file $3 served as $2
+#
+function served_as {
+    awk -v how="$2" -v file="/$3" '$5 == how && substr($7, length($7) - length(file) + 1) == file' $1 | wc -l
+}
+
+#######
+# Main
+#######
+
+# If there is no Tiny executable, then try to build it
+if [ ! -x ./tiny/tiny ]; then
+    (cd ./tiny; make)
+fi
+if [ ! -x ./proxy ] || [ ! -x ./tiny/tiny ]; then
+    echo "Error: ./proxy or ./tiny/tiny not found or not an executable file."
+    exit 1
+fi
+rm -rf ${PEER_DIR}
+mkdir ${PEER_DIR}
+
+trap 'echo "Timeout waiting for the server to grab the port reserved for it"; kill $$' ALRM
+trap 'kill ${tiny_pid} ${proxy_a_pid} ${proxy_b_pid} 2> /dev/null' EXIT
+
+tiny_port=$(free_port)
+echo "Starting tiny on ${tiny_port}"
+(cd ./tiny; exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_pid=$!
+wait_for_port_use "${tiny_port}"
+
+proxy_a_port=$(free_port)
+proxy_b_port=$(free_port)
+while [ ${proxy_b_port} -eq ${proxy_a_port} ]; do
+    proxy_b_port=$(free_port)
+done
+echo "Starting peers on ${proxy_a_port} and ${proxy_b_port}"
+./proxy -l ${PEER_DIR}/a.log -n localhost:${proxy_a_port} -p localhost:${proxy_b_port} \
+    ${proxy_a_port} &> /dev/null &
+proxy_a_pid=$!
+./proxy -l ${PEER_DIR}/b.log -n localhost:${proxy_b_port} -p localhost:${proxy_a_port} \
+    ${proxy_b_port} &> /dev/null &
+proxy_b_pid=$!
+wait_for_port_use "${proxy_a_port}"
+wait_for_port_use "${proxy_b_port}"
+
+numRun=0
+numSucceeded=0
+for file in ${FETCH_LIST}
+do
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: ${file}"
+    for proxy_port in ${proxy_a_port} ${proxy_b_port}
+    do
+        curl --max-time ${TIMEOUT} --silent --proxy http://localhost:${proxy_port} \
+            --output ${PEER_DIR}/${file}.${proxy_port} http://localhost:${tiny_port}/${file}
+        if ! cmp -s ${PEER_DIR}/${file}.${proxy_port} ./tiny/${file}; then
+            echo "   Failure: fetch through ${proxy_port} differs from ./tiny/${file}"
+            continue 2
+        fi
+    done
+
+    # Give both proxies a moment to write their log records.
+    sleep 0.2
+    peer_a=$(served_as ${PEER_DIR}/a.log PEER ${file})
+    peer_b=$(served_as ${PEER_DIR}/b.log PEER ${file})
+    miss=$(( $(served_as ${PEER_DIR}/a.log MISS ${file}) + $(served_as ${PEER_DIR}/b.log MISS ${file}) ))
+    if [ $(( peer_a + peer_b )) -eq 1 ] && [ ${miss} -eq 1 ]; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: served by its owner, PEER logged by the other proxy."
+    else
+        echo "   Failure: PEER records ${peer_a}/${peer_b}, MISS records ${miss}."
+    fi
+done
+
+echo "peerScore: ${numSucceeded}/${numRun}"
+[ ${numSucceeded} -eq ${numRun} ]
@@ -5,61 +5,240 @@
  * This program is a multi-threaded proxy server handling HTTP requests and responses. 
  * Key features:
  * - `doit`: Manages HTTP transactions, processing each client request.
+ *      Persistent client connections are supported, so pipelined requests
+ *      are answered in order out of the same rio buffer.
  * - `parse_uri`: Extracts host, port, and path from URIs for request routing.
- * - `build_requestheader`: Modifies and forwards HTTP request headers.
+ * - `build_requestheader`: Modifies and forwards HTTP request headers, through
+ *      the rules compiled by `filter` (built-in ones plus an optional config).
  * - `thread`: Operates as worker threads to handle requests concurrently.
- * - `init_cache`: Sets up cache for storing frequently accessed data.
+ * - `main`: Accepts connections in batches and sheds load with a fast 503
+ *      once the worker queue is full, instead of letting accept latency grow.
+ *      New connections wait in the conn loop until a whole request head has
+ *      arrived; only then is a worker given them.
+ *      SIGHUP reloads the filter and upstream configs. SIGUSR2 starts the
+ *      proxy binary anew (`upgrade`) and hands it the listening socket and
+ *      the cache; the old process then drains and exits.
+ * - `supervise`: With -w, forks that many worker processes, each with its
+ *      own threads, which share the listening socket and the cache. One
+ *      that dies is replaced without the others noticing.
+ * - `init_cache`: Sets up the cache in a shared-memory segment.
  * - `reader` and `writer`: 
- *      Implement cache access using a reader-writer model for thread safety.
+ *      Implement cache access without reader locks: readers copy objects
+ *      out of the segment under a per-slot generation check, and writers
+ *      only fill slots no reader can be sent to. Each worker thread also
+ *      keeps its hottest objects in a private L1.
+ * - Access logging goes through `alog`, so requests never wait on log I/O.
+ * - Clients are written to without blocking through `conn`: a client slower
+ *      than its response is parked in an event loop, with at most a
+ *      bounded amount buffered for it, and so are idle persistent connections.
+ * - Origins are chosen and connected to through `upstream`, which balances
+ *      configured backend groups and races connects across addresses.
+ *      In peer mode, misses for URIs another proxy owns are fetched from it.
  */
 #include <stdio.h>
 #include "csapp.h"
 #include "sbuf.h"
+#include "alog.h"
+#include "upstream.h"
+#include "deadline.h"
+#include "filter.h"
+#include "conn.h"
 #include<pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define NTHREADS 4 
 #define SBUFSIZE 16 
+#define KEEPALIVE_MS 1000 // Idle time before a persistent client connection is closed.
+#define CONNECT_TIMEOUT_MS 3000 // To get a connection to the origin, over all its addresses.
+#define HEADER_TIMEOUT_MS 5000 // For the client's request headers, and for the origin's response headers.
+#define BODY_IDLE_MS 5000 // Longest a body transfer may make no progress in either direction.
+#define TOTAL_TIMEOUT_MS 60000 // For a whole request; caps every deadline above.
+#define ACCEPT_BATCH 64 // Max connections accepted per listening-socket wakeup.
+#define ACCEPT_LOG_SAMPLE 64 // Log one accepted connection out of this many.
+#define L1_SLOTS 8 // Objects in each worker's private cache.
+#define L1_ADMIT_HITS 4 // Shared-cache hits before an object is copied into an L1.
+#define RELAYED 2 // doit() result: the conn loop relays the rest of the response.
+#define UPGRADE_WAIT_MS 10000 // For a new binary to say it is serving.
+#define DRAIN_MS 60000 // Longest an upgraded-away process waits for its connections.
+#define RESPAWN_MS 1000 // A worker process that lived less than this is restarted only after it.
+#define CACHE_LINES 10 // Objects in the shared cache.
+#define CACHE_SLOTS 16 // Lines plus spares, so a slot is only refilled long after its line let go.
+#define SLOT_BYTES (MAX_OBJECT_SIZE + MAXLINE) // An object and its URI.
+
+// filter.c frees a replaced rule set FILTER_GRACE_MS after the switch, with
+// no count of its readers: that is only safe while no request outlives it.
+_Static_assert(TOTAL_TIMEOUT_MS < FILTER_GRACE_MS, "a request could outlive its filter rules");
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *connect_hdr = "Connection: close\r\n";
-static const char *proxy_connect_hdr = "Proxy-Connection: close\r\n";
+static const char *peer_hdr = "X-Proxy-Peer: 1\r\n"; // Marks requests between cache peers.
+static const char *busy_response = "HTTP/1.0 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *bad_gateway = "HTTP/1.0 502 Bad Gateway\r\n"
+    "Connection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *gateway_timeout = "HTTP/1.0 504 Gateway Timeout\r\n"
+    "Connection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *forbidden = "HTTP/1.0 403 Forbidden\r\n"
+    "Connection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *length_required = "HTTP/1.0 411 Length Required\r\n"
+    "Connection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *upgrade_env = "PROXY_UPGRADE_FD"; // Set for a binary started by upgrade().
+static const char cache_magic[8] = "PXSHM01"; // Shared cache layout, checked on upgrade.
+
+/* accept4() is only declared under _GNU_SOURCE, which clashes with
+ * csapp.h's gai_error(); glibc always provides it. */
+extern int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 
 /*
- * reader-writer model
+ * Cache: one POSIX shared-memory segment holds the index and the object
+ * arena, so every worker process serves what any of them cached, and a
+ * binary started by upgrade() attaches it as it is. Each process may map
+ * it at a different address, so it holds no pointers: lines name slots by
+ * index, and a slot finds its bytes by offset from the segment start.
+ *
+ * Readers take no lock. A slot's generation is odd while a writer fills
+ * it, and changes again when its line lets go of it; a reader copies the
+ * object out and keeps the copy only if the generation it started with is
+ * still there. Writers serialize on a robust, process-shared mutex, so one
+ * dying while it holds it does not wedge the others, and only ever fill a
+ * slot no line points to.
  */
 typedef struct {
-    char *name;
-    char *object;
-    int used_cnt;
+    _Atomic unsigned gen; // Odd while being filled; bumped when its line lets go of it.
+    _Atomic int hits; // Hits since it was filled, for L1 admission.
+    unsigned off; // Object bytes, then the URI, from the segment start; set at creation.
+    unsigned hash; // fnv1a() of the URI.
+    int size; // Bytes stored in object.
+    int hdr_size; // Bytes of object before the blank line ending the headers.
+    int has_length; // Body is delimited by Content-Length, so the client connection may persist.
+    int name_len; // URI length, including the NUL.
+    unsigned freed; // Index clock when its line let go of it; the oldest is refilled first.
+} CacheSlot;
+
+typedef struct {
+    _Atomic int slot; // Index of the slot holding this line's object plus 1, 0 if empty.
+    unsigned used_cnt; // Index clock at the last write, for LRU; only touched by writers.
 } CacheLine;
 
 typedef struct {
-    int used_cnt;
-    CacheLine* objects;
-} Cache;
+    char magic[8]; // cache_magic, for a new binary deciding whether to attach.
+    unsigned index_size, slot_bytes; // The rest of the layout it must agree on.
+    pthread_mutex_t lock; // Serializes writers, across processes.
+    unsigned clock; // Ticks on every write; guarded by lock.
+    CacheLine lines[CACHE_LINES];
+    CacheSlot slots[CACHE_SLOTS];
+} CacheIndex;
+
+/*
+ * A reader's private copy of a cached object, reference-counted while the
+ * client is sent it and while it sits in an L1.
+ */
+typedef struct CacheObject {
+    _Atomic int refs; // One per reader or L1 holding it.
+    int slot; // The slot it was copied from...
+    unsigned gen; // ...and that slot's generation; once it moves on, the copy is stale.
+    int size, hdr_size, has_length; // As in the slot.
+    char *name; // URI, stored after the object.
+    char object[]; // Response headers (hop-by-hop ones removed), blank line, body.
+} CacheObject;
+
+/*
+ * Per-thread L1: references to copies of the objects this worker hits
+ * most. A hit here reads one generation out of the shared segment and
+ * copies nothing, so the hottest URIs cost no allocation and no lock.
+ */
+typedef struct {
+    unsigned hash; // fnv1a() of the URI.
+    CacheObject *obj; // Referenced; NULL if the slot is empty.
+    unsigned long used; // l1_clock at the last hit, for LRU replacement.
+} L1Entry;
+
+/*
+ * A response handed to the conn loop half-way: what the access log and the
+ * upstream need once the loop has relayed the rest.
+ */
+typedef struct {
+    char method[16];
+    char uri[MAXLINE];
+    int status;
+    int hit; // ALOG_MISS or ALOG_PEER.
+    long long sent; // Bytes sent before the hand-off.
+    long long ttfb;
+    ups_server_t *origin;
+    struct timespec start;
+} Relay;
+
 sbuf_t sbuf; // Shared buffer for producer-consumer model.
-Cache cache; // Instance of Cache to store the actual cache data.
-int readcnt; // Counter to keep track of the number of active readers.
-sem_t mutex, w; // Semaphores for synchronization. 
+CacheIndex *cache; // Start of the shared cache segment.
+static int cache_fd = -1; // The segment, kept open for upgrade().
+static __thread L1Entry l1[L1_SLOTS]; // This worker's hot objects.
+static __thread unsigned long l1_clock; // Ticks on every L1 hit or insert.
 int timen=0;
+static _Atomic int draining; // Set after an upgrade: no client connection outlives its request.
 
-void doit(int fd);
-// Manages HTTP request/response for the client connected via 'fd'.
+int doit(conn_t *c);
+// Manages one HTTP request/response for the client connection 'c'.
+// Returns 1 if the connection may carry another request, RELAYED if 'c' was handed off.
+void relay_done(conn_t *c, int ok);
+// Logs a response the conn loop finished relaying and releases its origin.
+int error_reply(conn_t *c, int status, char *method, char *uri, struct timespec *start);
+// Answers a denied request with 403, an unrelayable body with 411, or one the origin failed with 502 or 504; returns 0.
 void parse_uri(char *uri, char *host, char *port, char *path);
 // Extracts host, port, and path from the given 'uri'.
-void build_requestheader(rio_t *rp, char *newreq, char *method, char *hostname, char *port, char *path);
+int build_requestheader(rio_t *rp, char *newreq, char *method, char *hostname, char *port, char *path, int *keepalive, int *from_peer, long long *body, long long deadline);
 // Forms a new HTTP request header, storing it in 'newreq'.
+int relay_request_body(conn_t *c, int fd, long long len, long long deadline);
+// Copies the request body from the client to the server; -1 if the client fails, -2 the server.
+int peer_request(char *peer_req, char *req, char *method, char *host, char *port, char *path);
+// Builds in 'peer_req' the form of 'req' for a cache peer; -1 if it does not fit.
 void *thread(void* vargp);
 // Thread function for handling requests in a multi-threaded environment.
-void init_cache();
-// Sets up the caching system.
-int reader(int fd, char *uri);
-// Reads from cache for 'uri', sends data via 'fd' if available.
-void writer(char *uri, char *buf,int size);
+void reject_busy(int fd);
+// Answers an over-limit connection with 503 and closes it.
+void add_builtin_filters();
+// Registers the proxy's own header rules, ahead of any from a config file.
+void reload(char *filter_path, char *ups_path);
+// Re-reads the filter and upstream configs; a bad file keeps the old rules.
+int upgrade(char **argv, int listenfd);
+// Starts the proxy binary anew and hands over the socket and cache; 0 once it serves.
+int takeover(int chan, int *listenfd, int *cachefd, size_t *cachelen);
+// In a binary started by upgrade(): receives what the old process sends.
+void drain();
+// Lets the connections still open finish, then exits.
+void supervise(char **argv, int nprocs, int listenfd, int sigfd, int *chan);
+// Forks and minds the -w worker processes; returns only in a worker.
+void init_cache(int fd, size_t len);
+// Attaches the cache segment 'fd' from the old process, or creates a new one.
+int reader(conn_t *c, char *uri, int *keepalive);
+// Reads from cache for 'uri', sends data to 'c' if available.
+// Returns the number of bytes sent, 0 on a miss.
+int serve_object(conn_t *c, CacheObject *obj, int *keepalive);
+// Sends a cached object to the client; returns the bytes sent.
+CacheObject *fetch_object(char *uri, unsigned hash);
+// Copies the object cached for 'uri' out of the shared segment; NULL on a miss.
+CacheObject *l1_lookup(char *uri, unsigned hash);
+// Finds a live object in this thread's L1.
+void l1_insert(CacheObject *obj, unsigned hash);
+// Takes a reference to 'obj' into this thread's L1.
+void put_object(CacheObject *obj);
+// Drops a reference, freeing the object with the last one.
+void unref_object(void *obj);
+// put_object() for the conn module, which holds objects it is still sending.
+void cache_lock();
+// Takes the writers' mutex, recovering it from a process that died holding it.
+unsigned fnv1a(const char *s);
+// 32-bit FNV-1a hash of a string.
+long long elapsed_us(struct timespec *start);
+// Microseconds since 'start'.
+void writer(char *uri, char *buf, int size, int hdr_size, int has_length);
 // Writes 'buf' data to cache under 'uri'.
 
 /**
@@ -67,36 +246,155 @@ void writer(char *uri, char *buf,int size);
  * Sets up signal handling, initializes cache, creates worker threads,
  * and starts listening on the specified port for incoming connections. 
  * Accepts connections and dispatches them to worker threads for processing.
+ *
+ * Options: -b <backlog> sets the listen() backlog, -q <depth> the number of
+ * received requests that may wait for a worker before new connections get 503.
+ * -l <file> writes the access log there instead of stdout, -s <n> logs one
+ * request in n, and -r <n> caps log records per second per thread.
+ * -u <file> loads upstream groups (see upstream.h). -n <host:port> names this
+ * proxy and -p <host:port,...> its cache peers, turning on peer mode.
+ * -f <file> adds header, rewrite and deny rules (see filter.h).
+ * -w <n> serves from n worker processes sharing the socket and the cache.
+ *
+ * A binary started by upgrade() finds PROXY_UPGRADE_FD in its environment:
+ * the old process sends the listening socket and the cache over it, and
+ * is told when the new one serves. The port argument is then not used.
+ * SIGQUIT stops accepting and exits once the open connections are done.
  */
 int main(int argc, char **argv) {
-    int listenfd, connfd; // Listening and connection file descriptors.
-    char hostname[MAXLINE], port[MAXLINE]; // Store client hostname and port.
+    int listenfd, connfd, opt; // Listening and connection file descriptors.
+    int sigfd, chan = -1, cachefd = -1; // Signals; upgrade channel and cache from the old process.
+    size_t cachelen = 0;
+    sigset_t sigs;
+    struct signalfd_siginfo si;
+    int backlog = LISTENQ, max_queue = SBUFSIZE, nprocs = 1;
+    int log_sample = 1, log_rate = 0;
+    char *log_path = NULL, *ups_path = NULL, *self_name = NULL, *peer_list = NULL;
+    char *filter_path = NULL;
+    unsigned long accepted = 0, shed = 0; // Connection counters for the log.
+    char hostname[NI_MAXHOST], port[NI_MAXSERV]; // Store client address and port.
     socklen_t clientlen; // Length of client address.
     struct sockaddr_storage clientaddr; // Client address.
+    struct pollfd pfd[2]; // Readiness of the listening socket and the signalfd.
     pthread_t tid; // Thread identifier.
 
-    // Check command line arguments for port number.
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    // Parse options, then check command line arguments for port number.
+    while ((opt = getopt(argc, argv, "b:q:l:s:r:u:n:p:f:w:")) != -1) {
+        switch (opt) {
+        case 'b': backlog = atoi(optarg); break;
+        case 'q': max_queue = atoi(optarg); break;
+        case 'l': log_path = optarg; break;
+        case 's': log_sample = atoi(optarg); break;
+        case 'r': log_rate = atoi(optarg); break;
+        case 'u': ups_path = optarg; break;
+        case 'n': self_name = optarg; break;
+        case 'p': peer_list = optarg; break;
+        case 'f': filter_path = optarg; break;
+        case 'w': nprocs = atoi(optarg); break;
+        default: backlog = 0; break;
+        }
+    }
+    if (optind != argc - 1 || backlog <= 0 || max_queue <= 0 || nprocs <= 0 ||
+        !self_name != !peer_list) {
+        fprintf(stderr, "usage: %s [-b backlog] [-q max_queue] [-l access_log] "
+                "[-s sample_every] [-r max_per_sec] [-u upstreams] "
+                "[-n self -p peer,...] [-f filters] [-w processes] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    // SIGHUP, SIGUSR2 and SIGQUIT are read by the main loop from a signalfd
+    // (SIGCHLD too, by the supervisor). Block them before any thread starts,
+    // so that every thread inherits the mask.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGQUIT);
+    if (nprocs > 1) sigaddset(&sigs, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    if ((sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) unix_error("signalfd error");
+
+    if (getenv(upgrade_env)) { // Started by upgrade(): the old process has the socket.
+        chan = atoi(getenv(upgrade_env));
+        unsetenv(upgrade_env);
+        if (takeover(chan, &listenfd, &cachefd, &cachelen) < 0) {
+            fprintf(stderr, "upgrade: nothing received from the old process\n");
+            exit(1);
+        }
+    } else if ((listenfd = open_listenfd(argv[optind])) < 0) { // Open listening socket.
+        fprintf(stderr, "cannot listen on port %s\n", argv[optind]);
         exit(1);
     }
-    listenfd = open_listenfd(argv[1]); // Open listening socket.
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC); // Only upgrade() passes it on.
+    Listen(listenfd, backlog); // Listening again applies the configured backlog.
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK); // Batches end on EAGAIN.
     Signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE to handle broken pipe scenarios.
-    sbuf_init(&sbuf, SBUFSIZE); // Initialize the buffer.
-    init_cache(); // Initialize the cache.
+    init_cache(cachefd, cachelen); // Start warm with the old process's cache, if there is one.
+    add_builtin_filters();
+    if ((filter_path && filter_load(filter_path) < 0) || filter_compile() < 0) exit(1);
+
+    // Everything above is shared by the worker processes; threads start in each.
+    if (nprocs > 1) supervise(argv, nprocs, listenfd, sigfd, &chan);
+    sbuf_init(&sbuf, max_queue); // Initialize the buffer; its size is the admission limit.
+    conn_init(&sbuf, BODY_IDLE_MS, KEEPALIVE_MS, HEADER_TIMEOUT_MS); // Start the loop that parks slow and idle clients.
+    alog_init(log_path, log_sample, log_rate); // Start the access log writer.
+    if (ups_path) ups_init(ups_path); // Load upstream groups, start health checks.
+    if (peer_list) ups_peers(self_name, peer_list); // Join the cache cluster.
 
     // Create worker threads.
     for (int i = 0; i < NTHREADS; ++i) {
         Pthread_create(&tid, NULL, thread, NULL);
     }
+    if (chan >= 0) { // Serving now: the old process can stop accepting.
+        if (write(chan, "R", 1) != 1) alog_msg("upgrade: old process is gone");
+        close(chan);
+    }
 
-    // Main loop: accept and handle incoming connections.
+    // Main loop: wait for the listening socket, then accept everything queued.
     while (1) {
-        clientlen = sizeof(clientaddr);
-        connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
-        getnameinfo((SA*)&clientaddr,clientlen,hostname,MAXLINE,port,MAXLINE,0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        sbuf_insert(&sbuf, connfd); // Insert connection descriptor into buffer.
+        pfd[0].fd = listenfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = sigfd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) continue; // Interrupted by a signal.
+
+        while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+            if (si.ssi_signo == SIGHUP) {
+                reload(filter_path, ups_path);
+            } else if ((si.ssi_signo == SIGUSR2 && nprocs == 1 && upgrade(argv, listenfd) == 0) ||
+                       si.ssi_signo == SIGQUIT) { // Upgraded, or told to stop by the supervisor.
+                close(listenfd); // The new process has its own copy.
+                drain(); // Does not return.
+            }
+        }
+        if (!pfd[0].revents) continue;
+
+        for (int i = 0; i < ACCEPT_BATCH; i++) {
+            clientlen = sizeof(clientaddr);
+            connfd = accept4(listenfd, (SA *)&clientaddr, &clientlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connfd < 0) {
+                if (errno == EMFILE || errno == ENFILE) usleep(10000); // Let workers close some.
+                break; // EAGAIN: the accept queue is drained.
+            }
+            accepted++;
+
+            // Numeric only: a reverse DNS lookup here would stall every accept.
+            if (accepted % ACCEPT_LOG_SAMPLE == 1) {
+                getnameinfo((SA*)&clientaddr, clientlen, hostname, NI_MAXHOST, port, NI_MAXSERV,
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+                alog_msg("Accepted connection from (%s, %s) [%lu accepted, %lu shed]",
+                         hostname, port, accepted, shed);
+            }
+
+            // Admission control: while requests already wait for room on the
+            // full worker queue, turn new connections away. Otherwise the conn
+            // loop holds this one until its request head is in.
+            if (conn_backlogged() > 0) {
+                shed++;
+                reject_busy(connfd);
+            } else {
+                conn_accept(connfd);
+            }
+        }
     }
 
     // This line seems unused and could potentially be removed.
@@ -107,71 +405,289 @@ int main(int argc, char **argv) {
 
 /* 
  * doit - handle one HTTP request/response transaction.
- * Processes an HTTP request received on the file descriptor 'fd',
- * parses the request, and serves it either from cache or by forwarding it
- * to the intended server.
+ * Processes an HTTP request read from the client connection 'c', parses
+ * the request, and serves it either from cache or by forwarding it to the
+ * intended server. Nothing here waits on the client's reading: what it
+ * has not taken yet stays buffered in 'c'. Returns 1 if the client
+ * connection may be reused for another (possibly already pipelined)
+ * request, 0 if it must be closed, and RELAYED if it was handed to the
+ * conn loop together with the rest of the response.
  */
-void doit(int fd) {
+int doit(conn_t *c) {
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char host[MAXLINE], port[MAXLINE], path[MAXLINE];
-    char new_request[MAXLINE];
+    char new_request[MAXLINE], peer_req[MAXLINE], logged_uri[MAXLINE];
     char complete_uri[MAXLINE] = ""; // Initialize to empty string.
-    char object_buf[MAX_OBJECT_SIZE];
-    rio_t rio_client, rio_server;
-    int number, build_server;
-    int csize = 0;
+    char object_buf[MAX_OBJECT_SIZE], *body;
+    const char *extra; // Response headers added by filter rules.
+    rio_t rio_server;
+    ups_server_t *origin; // Upstream group member serving us, NULL for a direct connect.
+    long long ttfb = 0; // Microseconds until the origin's headers arrived.
+    int number, build_server, status = 0, keepalive;
+    int from_peer = 0; // Request came from a cache peer, so must not go to another.
+    int via_peer = 0; // Response comes from the peer owning the URI, which caches it.
+    int cacheable; // A GET without a body: the only request the cache answers or stores.
+    int csize = 0, hsize;
+    long long clen = -1; // Body length announced by the server, -1 if unknown.
+    long long req_body = 0; // Request body length, -1 if it cannot be relayed.
+    long long sent = 0; // Bytes written to the client, for the access log.
+    long long limit; // Deadline for the whole request; every phase is capped by it.
+    long long header_deadline; // When the origin must have sent all its headers.
+    struct timespec start; // When the request line arrived.
+    Relay *relay; // State for the conn loop, if the client falls behind.
 
-    rio_readinitb(&rio_client, fd); // Initialize RIO for client.
-    if (!rio_readlineb(&rio_client, buf, MAXLINE))  // Read request line.
-        return;
+    // Read request line, skipping blank lines between pipelined requests.
+    // The conn loop hands over a connection only once the whole request head
+    // is buffered, so neither this nor reading the headers waits on the client.
+    do {
+        if (dl_readlineb(&c->rio, buf, MAXLINE, dl_now() + KEEPALIVE_MS) <= 0)
+            return 0;
+    } while (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"));
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    limit = dl_now() + TOTAL_TIMEOUT_MS;
+    version[0] = '\0';
     sscanf(buf, "%s %s %s", method, uri, version); 
     // Parse method, URI, version.
+    strcpy(logged_uri, uri); // parse_uri() cuts the host out of 'uri'.
+    keepalive = !strcasecmp(version, "HTTP/1.1"); // HTTP/1.1 persists by default.
     parse_uri(uri, host, port, path); // Parse URI into host, port, path.
+    if (filter_url(host, port) < 0) // Denied host; a rewrite changes host and port.
+        return error_reply(c, 403, method, logged_uri, &start);
 
     // Constructing complete URI.
     sprintf(complete_uri, "%s%s", complete_uri, host);
     sprintf(complete_uri, "%s%s", complete_uri, port);
     sprintf(complete_uri, "%s%s", complete_uri, path);
 
-    // Serve from cache if possible.
-    if (reader(fd, complete_uri)) {
-        fprintf(stdout, "%s from cache\n", uri); // Log cache hit.
-        fflush(stdout);
-        return;
+    // Build new request header. This consumes the client's headers, which
+    // must happen even on a cache hit so the next pipelined request lines up.
+    if (build_requestheader(&c->rio, new_request, method, host, port, path, &keepalive,
+                            &from_peer, &req_body, dl_after(HEADER_TIMEOUT_MS, limit)) < 0)
+        return 0;
+    if (atomic_load(&draining)) keepalive = 0; // Upgraded: send the client to the new process.
+    // The origin gets HTTP/1.0, which has no chunked bodies, and without its
+    // length there is no telling where the body ends and the next request starts.
+    if (req_body < 0)
+        return error_reply(c, 411, method, logged_uri, &start);
+
+    // Serve from cache if possible. Cached objects are full GET responses:
+    // one must not answer a HEAD, whose client expects no body, nor a
+    // request with side effects. Those go to the origin, not to a peer.
+    cacheable = !strcasecmp(method, "GET") && req_body == 0;
+    if (cacheable && (sent = reader(c, complete_uri, &keepalive)) > 0) {
+        alog_request(method, logged_uri, 200, sent, ALOG_HIT, elapsed_us(&start)); // Log cache hit.
+        return keepalive;
     }
 
-    build_requestheader(&rio_client, new_request, method, host, port, path); 
-    // Build new request header.
-    build_server = open_clientfd(host, port); // Connect to the actual server.
+    // Ask the peer that owns this URI, if it is not us; otherwise, if the
+    // peer is unreachable, or if the peer's form of the request would not
+    // fit in a line buffer, connect to the actual server.
+    if (!from_peer && cacheable && peer_request(peer_req, new_request, method, host, port, path) == 0 &&
+        (build_server = ups_peer_connect(complete_uri,
+                        dl_after(CONNECT_TIMEOUT_MS, limit), &origin)) >= 0) {
+        via_peer = 1;
+        strcpy(new_request, peer_req);
+    } else {
+        build_server = ups_connect(host, port, complete_uri, dl_after(CONNECT_TIMEOUT_MS, limit), &origin);
+    }
     if (build_server < 0) {
-        fprintf(stderr, "connect to real server err\n"); 
-        // Log error if connection fails.
-        return;
+        alog_msg("connect to real server %s:%s err: %s", host, port, strerror(errno));
+        return error_reply(c, errno == ETIMEDOUT ? 504 : 502, method, logged_uri, &start);
     }
 
-    Rio_readinitb(&rio_server, build_server); // Initialize RIO for server.
-    Rio_writen(build_server, new_request, strlen(new_request)); 
+    rio_readinitb(&rio_server, build_server); // Initialize RIO for server.
     // Send the request to the server.
+    if (dl_writen(build_server, new_request, strlen(new_request), dl_after(HEADER_TIMEOUT_MS, limit)) < 0) {
+        status = errno == ETIMEDOUT ? 504 : 502;
+        goto origin_failed;
+    }
+    // Then the body, which must all be read for the next pipelined request to line up.
+    if (req_body > 0 && (number = relay_request_body(c, build_server, req_body, limit)) < 0) {
+        if (number == -2) {
+            status = errno == ETIMEDOUT ? 504 : 502;
+            goto origin_failed;
+        }
+        status = errno == ETIMEDOUT ? 408 : 400; // For the log; the client hung up or stalled mid-body.
+        ups_release(origin, 1, elapsed_us(&start)); // Not the origin's fault.
+        keepalive = 0;
+        goto done;
+    }
 
-    csize = 0; // Track size of the response.
-    while ((number = Rio_readlineb(&rio_server, buf, MAXLINE)) != 0) {
-        Rio_writen(fd, buf, number); // Write server response to client.
+    // Relay the status line and headers, dropping the hop-by-hop ones:
+    // the proxy decides itself whether the client connection persists.
+    // The origin has HEADER_TIMEOUT_MS to send all of them.
+    csize = via_peer || !cacheable ? -1 : 0; // Track size of the response; the owning peer caches it, not us.
+    header_deadline = dl_after(HEADER_TIMEOUT_MS, limit);
+    while ((number = dl_readlineb(&rio_server, buf, MAXLINE, header_deadline)) > 0) {
+        if (!status) {
+            // Only full 200 responses are cacheable; a 206 range or a
+            // 304 revalidation must never stand in for the whole object.
+            sscanf(buf, "%*s %d", &status);
+            if (status != 200) csize = -1;
+        }
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) break;
+        if (!filter_response(buf, &clen)) continue; // Hop-by-hop, or removed by a rule.
+        if (conn_write(c, buf, number) < 0) {
+            ups_release(origin, 1, elapsed_us(&start)); // Not the origin's fault.
+            keepalive = 0; // Client is gone; give up on it.
+            goto done;
+        }
+        sent += number;
+        if (csize != -1 && csize + number + 2 <= MAX_OBJECT_SIZE) {
+            memcpy(object_buf + csize, buf, number); // Append to cache buffer.
+            csize += number;
+        } else {
+            csize = -1; // Mark as too large to cache.
+        }
+    }
+    if (number <= 0) { // Server hung up or stalled in the middle of the headers.
+        status = number < 0 && errno == ETIMEDOUT ? 504 : 502;
+        if (sent == 0) goto origin_failed;
+        ups_release(origin, 0, 0);
+        keepalive = 0;
+        goto done;
+    }
+    ttfb = elapsed_us(&start);
+
+    // These responses never carry a body, whatever the headers say.
+    if (status == 204 || status == 304 || status / 100 == 1 || !strcasecmp(method, "HEAD"))
+        clen = 0;
+    if (clen < 0)
+        keepalive = 0; // Body ends when the server closes, so must ours.
+
+    // Headers added by the response rules belong to the object; ours does not.
+    extra = filter_response_extra();
+    if (csize != -1 && csize + strlen(extra) + 2 <= MAX_OBJECT_SIZE) {
+        memcpy(object_buf + csize, extra, strlen(extra));
+        csize += strlen(extra);
+    } else {
+        csize = -1;
+    }
+    sprintf(buf, "%sConnection: %s\r\n\r\n", extra, keepalive ? "keep-alive" : "close");
+    if (conn_write(c, buf, strlen(buf)) < 0) {
+        ups_release(origin, 1, ttfb);
+        keepalive = 0;
+        goto done;
+    }
+    sent += strlen(buf);
+    hsize = csize;
+    if (csize != -1) {
+        memcpy(object_buf + csize, "\r\n", 2);
+        csize += 2;
+    }
+
+    // Relay the body straight out of the server's read buffer: exactly
+    // Content-Length bytes, or until the server closes. The server going
+    // quiet for BODY_IDLE_MS ends the transfer.
+    while (clen != 0) {
+        if (conn_full(c)) {
+            // The client is slower than the server. Rather than hold this
+            // thread, hand the rest to the conn loop, which reads the server
+            // only as fast as the client drains. A response this large is
+            // past MAX_OBJECT_SIZE, so there is nothing left to cache.
+            while (clen != 0 && rio_server.rio_cnt > 0) {
+                number = rio_peek(&rio_server, &body);
+                if (clen > 0 && number > clen) number = clen;
+                conn_write(c, body, number);
+                sent += number;
+                if (clen > 0) clen -= number;
+                rio_consume(&rio_server, number);
+            }
+            rio_freeb(&rio_server);
+            relay = Malloc(sizeof(Relay));
+            snprintf(relay->method, sizeof(relay->method), "%.15s", method);
+            strcpy(relay->uri, logged_uri);
+            relay->status = status;
+            relay->hit = via_peer ? ALOG_PEER : ALOG_MISS;
+            relay->sent = sent;
+            relay->ttfb = ttfb;
+            relay->origin = origin;
+            relay->start = start;
+            conn_park_relay(c, build_server, clen, keepalive, relay_done, relay);
+            return RELAYED;
+        }
+        if ((number = dl_peek(&rio_server, &body, dl_after(BODY_IDLE_MS, limit))) <= 0) break;
+        if (clen > 0 && number > clen) number = clen;
+        if (conn_write(c, body, number) < 0) {
+            csize = -1;
+            keepalive = 0;
+            break;
+        }
+        sent += number;
+        if (clen > 0) clen -= number;
         if (csize + number > MAX_OBJECT_SIZE) {
             csize = -1; // Mark as too large to cache.
         }
         if (csize != -1) {
-            printf("get %d bytes from server\n", number); // Log received bytes.
-            memcpy(object_buf + csize, buf, number); // Append to cache buffer.
+            memcpy(object_buf + csize, body, number); // Append to cache buffer.
             csize += number;
         }
+        rio_consume(&rio_server, number);
+    }
+    if (clen > 0 || number < 0) { // Truncated or stalled body: neither cacheable nor reusable.
+        csize = -1;
+        keepalive = 0;
     }
 
     if (csize != -1) {
-        writer(complete_uri, object_buf,csize); // Cache the response.
+        writer(complete_uri, object_buf, csize, hsize, clen == 0); // Cache the response.
     }
 
+    ups_release(origin, status < 500 && clen <= 0 && number >= 0, ttfb); // 5xx or truncated counts against it.
+    goto done;
+
+origin_failed: // Nothing was sent to the client yet, so it gets a 502 or 504.
+    ups_release(origin, 0, 0);
+    rio_freeb(&rio_server);
+    close(build_server);
+    return error_reply(c, status, method, logged_uri, &start);
+
+done:
+    rio_freeb(&rio_server);
     close(build_server); // Close server connection.
+    alog_request(method, logged_uri, status, sent, via_peer ? ALOG_PEER : ALOG_MISS, elapsed_us(&start));
+    return keepalive;
+}
+
+/*
+ * error_reply - answer a request with 'status' (403 for a denied host, 411
+ * for a body that cannot be relayed, 502 or 504 for a failed origin) and
+ * log it. The client connection is always
+ * closed afterwards, once the reply is out: its request headers may not
+ * have been read, and the origin's part of the exchange is unknown.
+ */
+int error_reply(conn_t *c, int status, char *method, char *uri, struct timespec *start) {
+    const char *msg = status == 403 ? forbidden : status == 411 ? length_required :
+        status == 504 ? gateway_timeout : bad_gateway;
+
+    conn_write(c, msg, strlen(msg));
+    alog_request(method, uri, status, strlen(msg), ALOG_MISS, elapsed_us(start));
+    return 0;
+}
+
+/*
+ * relay_done - called on the conn loop thread when it is done with the
+ * server of a response handed over by doit(); 'ok' is 0 if the server
+ * failed. Finishes what doit() would have done at that point.
+ */
+void relay_done(conn_t *c, int ok) {
+    Relay *relay = c->ctx;
+
+    ups_release(relay->origin, ok && relay->status < 500, relay->ttfb);
+    alog_request(relay->method, relay->uri, relay->status, relay->sent + c->relayed, relay->hit,
+                 elapsed_us(&relay->start));
+    free(relay);
+}
+
+/*
+ * elapsed_us - microseconds of CLOCK_MONOTONIC time since 'start'.
+ */
+long long elapsed_us(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
 /*
@@ -227,112 +743,618 @@ void parse_uri(char *uri, char *host, char *port, char *path) {
 /**
  * Constructs the HTTP request header for the proxy.
  * Filters out certain headers from the original request and adds necessary headers.
+ * Updates '*keepalive' from the client's Connection/Proxy-Connection headers,
+ * sets '*from_peer' if the request was forwarded by a cache peer, and sets
+ * '*body' to the length of the request body, -1 if it is not known up front.
+ * Returns -1 if the client hung up, or had not sent all its headers by 'deadline'.
  */
-void build_requestheader(rio_t *rp, char *newreq, char *method, char *hostname, char *port, char *path) {
+int build_requestheader(rio_t *rp, char *newreq, char *method, char *hostname, char *port, char *path, int *keepalive, int *from_peer, long long *body, long long deadline) {
+    char buf[MAXLINE], raw[MAXLINE]; // Current line; all kept lines, NUL-separated.
+    hdr_t hdrs[FILTER_MAX_HEADERS]; // Parsed headers, pointing into 'raw'.
+    int n = 0;
+    size_t used = 0;
+    ssize_t len;
+
+    // Read lines from client input into the header vector. Headers beyond
+    // what the request can carry are dropped, as are malformed lines.
+    while (1) {
+        if ((len = dl_readlineb(rp, buf, MAXLINE, deadline)) <= 0) return -1;
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) break; // End of request headers.
+        if (n == FILTER_MAX_HEADERS || used + len + 1 > MAXLINE) continue;
+        memcpy(raw + used, buf, len + 1);
+        if (filter_parse(raw + used, len, &hdrs[n]) == 0) n++;
+        used += len + 1;
+    }
+
+    // One pass of the request rules emits what to forward, Host and the
+    // proxy's own User-Agent and Connection headers included.
     sprintf(newreq, "%s %s HTTP/1.0\r\n", method, path); // Start constructing the new request header.
+    used = strlen(newreq);
+    return filter_request_headers(hdrs, n, hostname, port, newreq + used, MAXLINE - used,
+                                  keepalive, from_peer, body);
+}
+
+/**
+ * Copies the 'len' bytes of request body that follow the headers from the
+ * client 'c' to the server 'fd', straight out of the client's read buffer.
+ * Either side going quiet for BODY_IDLE_MS, or past 'deadline', ends it.
+ * Returns 0 once all of it is sent, -1 if the client hung up or stalled,
+ * and -2 if the server did (errno is ETIMEDOUT for a stall).
+ */
+int relay_request_body(conn_t *c, int fd, long long len, long long deadline) {
+    ssize_t n;
+    char *p;
 
+    while (len > 0) {
+        if ((n = dl_peek(&c->rio, &p, dl_after(BODY_IDLE_MS, deadline))) <= 0) {
+            if (n == 0) errno = ECONNRESET;
+            return -1;
+        }
+        if (n > len) n = len;
+        if (dl_writen(fd, p, n, dl_after(BODY_IDLE_MS, deadline)) < 0)
+            return -2;
+        rio_consume(&c->rio, n);
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Builds in 'peer_req' (MAXLINE bytes) the form of 'req', a request built for
+ * the origin, that goes to the cache peer owning the URI: the request line
+ * gets the absolute URI back, so the peer keys its cache the same way, and
+ * the peer marker is added so the peer serves it itself instead of
+ * forwarding it around the ring. Returns -1 if that does not fit, since a
+ * cut-off request would leave the peer waiting for the rest of its headers.
+ */
+int peer_request(char *peer_req, char *req, char *method, char *host, char *port, char *path) {
+    int n;
+
+    n = snprintf(peer_req, MAXLINE, "%s http://%s:%s%s HTTP/1.0\r\n%s%s", method, host, port,
+                 path, peer_hdr, strchr(req, '\n') + 1); // Everything after the request line.
+    return n < 0 || n >= MAXLINE ? -1 : 0;
+}
+
+/**
+ * Answers a connection that exceeds the admission limit with 503.
+ * The socket is non-blocking, so this never stalls the accept loop; any
+ * request bytes already received are drained so close() sends FIN, not RST.
+ */
+void reject_busy(int fd) {
     char buf[MAXLINE];
-    // Read lines from client input.
-    while (Rio_readlineb(rp, buf, MAXLINE) > 0) {
-        if (!strcmp(buf, "\r\n")) break; // End of request headers.
 
-        // Skip headers that will be set by the proxy.
-        if (strstr(buf, "Host:") != NULL || strstr(buf, "User-Agent:") != NULL || 
-            strstr(buf, "Connection:") != NULL || strstr(buf, "Proxy-Connection:") != NULL) continue;
+    recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    send(fd, busy_response, strlen(busy_response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+/**
+ * Registers the built-in header rules in the filter set being built: the
+ * proxy sets Host, User-Agent and the connection headers itself, and
+ * decides about persistence per hop.
+ */
+void add_builtin_filters() {
+    filter_add(FILTER_REQUEST, "Host", F_REMOVE, NULL); // Re-added from the URI.
+    filter_add(FILTER_REQUEST, "User-Agent", F_REMOVE | F_ADD, strchr(user_agent_hdr, ':') + 2);
+    filter_add(FILTER_REQUEST, "Connection", F_REMOVE | F_ADD | F_KEEPALIVE, "close");
+    filter_add(FILTER_REQUEST, "Proxy-Connection", F_REMOVE | F_ADD | F_KEEPALIVE, "close");
+    filter_add(FILTER_REQUEST, "Keep-Alive", F_REMOVE, NULL);
+    filter_add(FILTER_REQUEST, "X-Proxy-Peer", F_REMOVE | F_PEER, NULL);
+    filter_add(FILTER_REQUEST, "Content-Length", F_CLEN, NULL);
+    filter_add(FILTER_REQUEST, "Transfer-Encoding", F_TENC, NULL);
+    filter_add(FILTER_RESPONSE, "Connection", F_REMOVE, NULL);
+    filter_add(FILTER_RESPONSE, "Proxy-Connection", F_REMOVE, NULL);
+    filter_add(FILTER_RESPONSE, "Keep-Alive", F_REMOVE, NULL);
+    filter_add(FILTER_RESPONSE, "Content-Length", F_CLEN, NULL);
+}
+
+/**
+ * SIGHUP: rebuilds the filter rules and upstream groups from their config
+ * files. Requests already running finish with what they started with; a
+ * file that fails to load leaves its part of the configuration as it was.
+ */
+void reload(char *filter_path, char *ups_path) {
+    add_builtin_filters();
+    if (filter_path && filter_load(filter_path) < 0) {
+        filter_abort();
+        alog_msg("reload: %s is bad, filter rules unchanged", filter_path);
+    } else if (filter_compile() < 0) {
+        alog_msg("reload: filter rules unchanged");
+    }
+    if (ups_path && ups_reload(ups_path) < 0)
+        alog_msg("reload: %s is bad, upstream groups unchanged", ups_path);
+    alog_msg("reload: done");
+}
+
+/**
+ * SIGUSR2: starts the binary at argv[0] with the same arguments, and sends
+ * it the listening socket and the cache segment over a socketpair
+ * (SCM_RIGHTS); until this process exits both write to the same cache. Returns 0 once the new process says it is serving; the
+ * caller then stops accepting. If it fails to start, it is killed and this
+ * process carries on as before.
+ */
+int upgrade(char **argv, int listenfd) {
+    extern char **environ;
+    int sv[2], fds[2], n = 0, rc;
+    size_t cachelen = sizeof(CacheIndex) + CACHE_SLOTS * SLOT_BYTES, len = strlen(upgrade_env);
+    char var[64], ack = 0, **env;
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(fds))]; } ctl; // Aligned for cmsghdr.
+    struct iovec iov = { &cachelen, sizeof(cachelen) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    pid_t pid;
 
-        sprintf(newreq, "%s%s", newreq, buf); // Add other headers from the client request.
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        alog_msg("upgrade: socketpair: %s", strerror(errno));
+        return -1;
     }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC); // The child only gets its own end.
 
-    // Add necessary headers.
-    sprintf(newreq, "%sHost: %s:%s\r\n", newreq, hostname, port);
-    sprintf(newreq, "%s%s", newreq, user_agent_hdr); // User-Agent header.
-    sprintf(newreq, "%s%s", newreq, connect_hdr); // Connection header.
-    sprintf(newreq, "%s%s", newreq, proxy_connect_hdr); // Proxy-Connection header.
-    sprintf(newreq, "%s\r\n", newreq); // End of headers.
+    // After fork() the child of a threaded process may only exec, so its
+    // environment is built here: ours, plus where to find the channel.
+    while (environ[n]) n++;
+    env = Malloc((n + 2) * sizeof(char *));
+    n = 0;
+    for (char **e = environ; *e; e++) {
+        if (strncmp(*e, upgrade_env, len) || (*e)[len] != '=') env[n++] = *e;
+    }
+    snprintf(var, sizeof(var), "%s=%d", upgrade_env, sv[1]);
+    env[n++] = var;
+    env[n] = NULL;
+    if ((pid = fork()) == 0) {
+        environ = env;
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    free(env);
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        alog_msg("upgrade: fork: %s", strerror(errno));
+        return -1;
+    }
+
+    // Socket and cache go in one message; the cache length is its payload.
+    fds[0] = listenfd;
+    fds[1] = cache_fd;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    rc = sendmsg(sv[0], &msg, MSG_NOSIGNAL);
+
+    if (rc < 0 || dl_wait(sv[0], POLLIN, dl_now() + UPGRADE_WAIT_MS) < 0 ||
+        read(sv[0], &ack, 1) != 1 || ack != 'R') {
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        alog_msg("upgrade: %s did not start, still serving", argv[0]);
+        return -1;
+    }
+    close(sv[0]);
+    alog_msg("upgrade: pid %d is serving, draining", (int)pid);
+    return 0;
+}
+
+/**
+ * Receives, on the channel from upgrade(), the listening socket and the
+ * cache segment: '*cachefd' is -1 if the old process sent none.
+ */
+int takeover(int chan, int *listenfd, int *cachefd, size_t *cachelen) {
+    int fds[2], nfds;
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(fds))]; } ctl;
+    struct iovec iov = { cachelen, sizeof(*cachelen) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    fcntl(chan, F_SETFD, FD_CLOEXEC);
+    if (recvmsg(chan, &msg, 0) != sizeof(*cachelen) || (cm = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        return -1;
+    nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (nfds < 1 || nfds > 2) return -1;
+    memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+    *listenfd = fds[0];
+    *cachefd = nfds == 2 ? fds[1] : -1;
+    if (*cachefd >= 0) fcntl(*cachefd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/**
+ * Runs in the main thread once another process accepts in our place, or
+ * on SIGQUIT. New requests on the connections still open get
+ * "Connection: close"; when the last connection is gone, or after
+ * DRAIN_MS, the process exits.
+ */
+void drain() {
+    long long deadline = dl_now() + DRAIN_MS;
+    int queued;
+
+    atomic_store(&draining, 1);
+    do {
+        usleep(50000);
+        sem_getvalue(&sbuf.items, &queued); // Accepted, not yet picked up by a worker.
+    } while ((conn_count() > 0 || queued > 0) && dl_now() < deadline);
+    alog_msg("drain: %d connections left, exiting", conn_count());
+    usleep(2 * ALOG_FLUSH_MS * 1000); // Let the log writer catch up.
+    exit(0);
+}
+
+/**
+ * With -w, the first process only forks the workers and minds them; it
+ * stays single-threaded, so it can fork again at any time. Returns in
+ * each worker, never in the supervisor. A worker that dies is replaced,
+ * after RESPAWN_MS if it died young; the others, and the connections they
+ * hold, never notice. SIGHUP is passed on to every worker. SIGUSR2
+ * upgrades the group: once the new binary serves, every worker gets
+ * SIGQUIT, and the supervisor exits after the last. SIGQUIT alone stops
+ * the group the same way.
+ */
+void supervise(char **argv, int nprocs, int listenfd, int sigfd, int *chan) {
+    pid_t *pids = Calloc(nprocs, sizeof(pid_t)), pid, self = getpid(); // 0 for a free place.
+    long long *when = Calloc(nprocs, sizeof(long long)); // Start time, or earliest restart if free.
+    long long now, wait;
+    int i, live = 0, stopping = 0, status;
+    struct signalfd_siginfo si;
+    struct pollfd pfd;
+
+    while (1) {
+        now = dl_now();
+        wait = -1;
+        for (i = 0; i < nprocs && !stopping; i++) {
+            if (pids[i]) continue;
+            if (now < when[i]) {
+                if (wait < 0 || when[i] - now < wait) wait = when[i] - now;
+                continue;
+            }
+            if ((pid = fork()) == 0) {
+                prctl(PR_SET_PDEATHSIG, SIGQUIT); // Drain should the supervisor die unannounced.
+                if (getppid() != self) exit(0); // It already has.
+                if (*chan >= 0) close(*chan); // Only the supervisor answers the old process.
+                *chan = -1;
+                free(pids);
+                free(when);
+                return;
+            }
+            if (pid < 0) {
+                alog_msg("supervisor: fork: %s", strerror(errno));
+                when[i] = now + RESPAWN_MS;
+                wait = RESPAWN_MS;
+                continue;
+            }
+            pids[i] = pid;
+            when[i] = now;
+            live++;
+        }
+        if (*chan >= 0) { // Workers are up: the old process can stop accepting.
+            if (write(*chan, "R", 1) != 1) alog_msg("upgrade: old process is gone");
+            close(*chan);
+            *chan = -1;
+        }
+        if (stopping && live == 0) {
+            alog_msg("supervisor: all workers stopped, exiting");
+            exit(0);
+        }
+
+        pfd.fd = sigfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, wait) <= 0) continue; // Time to restart a worker.
+        while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+            if (si.ssi_signo == SIGCHLD) {
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                    for (i = 0; i < nprocs && pids[i] != pid; i++)
+                        ;
+                    if (i == nprocs) continue; // Not a worker: a binary upgrade() gave up on.
+                    pids[i] = 0;
+                    live--;
+                    if (stopping) continue;
+                    alog_msg("supervisor: worker %d %s %d, restarting", (int)pid,
+                             WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                             WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                    when[i] = dl_now() - when[i] < RESPAWN_MS ? dl_now() + RESPAWN_MS : 0;
+                }
+            } else if (si.ssi_signo == SIGHUP) {
+                for (i = 0; i < nprocs; i++) {
+                    if (pids[i]) kill(pids[i], SIGHUP);
+                }
+            } else if (!stopping && (si.ssi_signo == SIGQUIT ||
+                                     (si.ssi_signo == SIGUSR2 && upgrade(argv, listenfd) == 0))) {
+                stopping = 1;
+                close(listenfd);
+                for (i = 0; i < nprocs; i++) {
+                    if (pids[i]) kill(pids[i], SIGQUIT);
+                }
+            }
+        }
+    }
 }
 
 /**
  * Worker thread function.
- * Detaches itself and processes requests from clients in a loop.
+ * Detaches itself and processes requests from clients in a loop, never
+ * waiting on a client that is slow to read.
  */
 void *thread(void* ptr){
     Pthread_detach(Pthread_self()); // Detach thread for autonomous cleanup.
 
     while (1) {
-        int connfd = sbuf_remove(&sbuf); // Retrieve a connection descriptor from the buffer.
-        doit(connfd); // Handle the HTTP request/response transaction.
-        Close(connfd); // Close the connection.
+        // A connection whose next request head the conn loop has buffered.
+        conn_t *c = conn_get(sbuf_remove(&sbuf));
+        int rc;
+
+        // The socket stays non-blocking: doit() bounds every wait with a deadline.
+        // Handle requests for as long as the next one is already here in full; a
+        // client still reading its response, or yet to send another request, is parked.
+        while ((rc = doit(c)) == 1 && conn_pending(c) == 0 && conn_head_ready(c))
+            ;
+        if (rc != RELAYED) conn_park(c, rc);
     }
 }
 
 /**
  * Initializes the cache.
- * Allocates memory for cache lines and sets up synchronization primitives.
+ * Attaches the segment an upgrading process passed in 'fd' if its layout is
+ * ours; otherwise creates an empty one. Either way the segment is mapped
+ * before any worker process is forked, and stays open for upgrade().
  */
-void init_cache() {
-    Sem_init(&mutex, 0, 1); // Initialize the mutex semaphore for protecting readcnt.
-    Sem_init(&w, 0, 1); // Initialize the writer semaphore for exclusive write access.
-    readcnt = 0; // Initialize the reader count.
+void init_cache(int fd, size_t len) {
+    size_t size = sizeof(CacheIndex) + CACHE_SLOTS * SLOT_BYTES;
+    pthread_mutexattr_t attr;
+    char name[64];
+    int n = 0;
 
-    // Allocate memory for 10 cache lines.
-    cache.objects = (CacheLine*)Malloc(sizeof(CacheLine) * 10);
-    cache.used_cnt = 0;
-    for (int i = 0; i < 10; i++) {
-        cache.objects[i].name = Malloc(sizeof(char) * MAXLINE); // Allocate memory for the name.
-        cache.objects[i].object = Malloc(sizeof(char) * MAX_OBJECT_SIZE); // Allocate memory for the object.
-        cache.objects[i].used_cnt = 0; // Initialize the used count for LRU tracking.
+    if (fd >= 0) {
+        if (len == size && (cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+            if (!memcmp(cache->magic, cache_magic, sizeof(cache->magic)) &&
+                cache->index_size == sizeof(CacheIndex) && cache->slot_bytes == SLOT_BYTES) {
+                for (int i = 0; i < CACHE_LINES; i++) n += atomic_load(&cache->lines[i].slot) != 0;
+                alog_msg("upgrade: attached the cache, %d objects", n);
+                cache_fd = fd;
+                return;
+            }
+            munmap(cache, size);
+        }
+        alog_msg("upgrade: cache layout changed, starting empty");
+        close(fd);
     }
+
+    // The name is only used to create the segment; the descriptor keeps it.
+    snprintf(name, sizeof(name), "/proxy-cache-%d", (int)getpid());
+    if ((cache_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) unix_error("shm_open error");
+    shm_unlink(name);
+    fcntl(cache_fd, F_SETFD, FD_CLOEXEC); // Only upgrade() passes it on.
+    if (ftruncate(cache_fd, size) < 0) unix_error("ftruncate error");
+    cache = Mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache_fd, 0); // Zero-filled.
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    for (int i = 0; i < CACHE_SLOTS; i++) cache->slots[i].off = sizeof(CacheIndex) + i * SLOT_BYTES;
+    cache->index_size = sizeof(CacheIndex);
+    cache->slot_bytes = SLOT_BYTES;
+    memcpy(cache->magic, cache_magic, sizeof(cache->magic));
 }
 
 /**
- * Reader function in the reader-writer model.
- * Checks if the requested URI is in the cache and serves it if present.
- */
-int reader(int fd, char *uri) {
-    int in_cache = 0;
-
-    P(&mutex); // Lock to increment readcnt.
-    readcnt++;
-    if (readcnt == 1) P(&w); // First reader acquires writer lock.
-    V(&mutex); // Unlock after incrementing readcnt.
-
-    // Search the cache for the URI.
-    for (int i = 0; i < 10; ++i) {
-        if (!strcmp(cache.objects[i].name, uri)) {
-            Rio_writen(fd, cache.objects[i].object, MAX_OBJECT_SIZE); // Serve from cache.
-            in_cache = 1;
-            break;
+ * Reader function.
+ * Checks this thread's L1 first, then the shared cache, and serves the
+ * object if present. What the shared cache has is copied out first, so
+ * the client write happens with nothing shared held and no lock taken.
+ * An object hit often enough in the shared cache, by any process, is
+ * kept in the L1 of the thread that hits it next.
+ * Clears '*keepalive' if the cached body is not length-delimited, or if the
+ * client is gone.
+ * Returns the number of bytes sent, or 0 if the URI is not cached.
+ */
+int reader(conn_t *c, char *uri, int *keepalive) {
+    unsigned hash = fnv1a(uri);
+    CacheObject *obj;
+    int sent;
+
+    if ((obj = l1_lookup(uri, hash)) != NULL) // Hot object: no shared writes at all.
+        return serve_object(c, obj, keepalive);
+    if ((obj = fetch_object(uri, hash)) == NULL)
+        return 0; // Miss.
+
+    if (atomic_fetch_add(&cache->slots[obj->slot].hits, 1) + 1 >= L1_ADMIT_HITS)
+        l1_insert(obj, hash);
+    sent = serve_object(c, obj, keepalive); // Serve from cache.
+    put_object(obj);
+    return sent;
+}
+
+/**
+ * Searches the shared cache for 'uri' and copies its object into a private,
+ * referenced CacheObject. A slot is read like a seqlock: its generation is
+ * checked before and after the copy, and a copy made while a writer
+ * refilled the slot is thrown away. Reads before that check only have to
+ * stay inside the slot.
+ */
+CacheObject *fetch_object(char *uri, unsigned hash) {
+    int name_len = strlen(uri) + 1, s, size;
+    char *base = (char *)cache;
+    CacheSlot *slot;
+    CacheObject *obj;
+    unsigned gen;
+
+    for (int i = 0; i < CACHE_LINES; i++) {
+        if ((s = atomic_load_explicit(&cache->lines[i].slot, memory_order_acquire) - 1) < 0) continue;
+        slot = &cache->slots[s];
+        gen = atomic_load_explicit(&slot->gen, memory_order_acquire);
+        size = slot->size;
+        if ((gen & 1) || slot->hash != hash || slot->name_len != name_len ||
+            size < 0 || size > MAX_OBJECT_SIZE || memcmp(base + slot->off + size, uri, name_len))
+            continue;
+
+        obj = Malloc(sizeof(CacheObject) + size + name_len);
+        memcpy(obj->object, base + slot->off, size + name_len);
+        obj->size = size;
+        obj->hdr_size = slot->hdr_size;
+        obj->has_length = slot->has_length;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->gen, memory_order_relaxed) != gen) { // Refilled meanwhile.
+            free(obj);
+            continue;
+        }
+        atomic_init(&obj->refs, 1);
+        obj->slot = s;
+        obj->gen = gen;
+        obj->name = obj->object + size;
+        return obj;
+    }
+    return NULL;
+}
+
+/**
+ * Sends the cached object 'obj' to the client: its headers, our own
+ * Connection header, then the body. A body the client does not take at
+ * once is sent later by the conn loop straight from the object, which it
+ * keeps a reference to until then.
+ */
+int serve_object(conn_t *c, CacheObject *obj, int *keepalive) {
+    char conn[MAXLINE];
+
+    if (!obj->has_length) *keepalive = 0;
+    sprintf(conn, "Connection: %s\r\n", *keepalive ? "keep-alive" : "close");
+    conn_write(c, obj->object, obj->hdr_size);
+    conn_write(c, conn, strlen(conn));
+    atomic_fetch_add(&obj->refs, 1); // conn_write_ref() drops it once sent, or at once if it fails.
+    if (conn_write_ref(c, obj->object + obj->hdr_size, obj->size - obj->hdr_size,
+                       obj, unref_object) < 0) // Fails if either write above did.
+        *keepalive = 0;
+    return obj->size + strlen(conn);
+}
+
+/**
+ * Looks 'uri' up in this thread's L1. Entries whose object the shared
+ * cache has since dropped are released here, lazily, so writers never
+ * have to reach into other threads', or other processes', L1s.
+ */
+CacheObject *l1_lookup(char *uri, unsigned hash) {
+    for (int i = 0; i < L1_SLOTS; i++) {
+        CacheObject *obj = l1[i].obj;
+        if (!obj || l1[i].hash != hash || strcmp(obj->name, uri)) continue;
+        if (atomic_load_explicit(&cache->slots[obj->slot].gen, memory_order_acquire) != obj->gen) {
+            l1[i].obj = NULL;
+            put_object(obj);
+            return NULL;
         }
+        l1[i].used = ++l1_clock;
+        return obj;
+    }
+    return NULL;
+}
+
+/**
+ * Adds 'obj' to this thread's L1 in place of its least recently used
+ * entry. The caller must hold a reference for the duration.
+ */
+void l1_insert(CacheObject *obj, unsigned hash) {
+    int victim = 0;
+
+    for (int i = 1; i < L1_SLOTS; i++) {
+        if (l1[i].used < l1[victim].used) victim = i;
     }
+    atomic_fetch_add(&obj->refs, 1);
+    if (l1[victim].obj) put_object(l1[victim].obj);
+    l1[victim].obj = obj;
+    l1[victim].hash = hash;
+    l1[victim].used = ++l1_clock;
+}
+
+/**
+ * Drops one reference to 'obj', freeing it with the last.
+ */
+void put_object(CacheObject *obj) {
+    if (atomic_fetch_sub_explicit(&obj->refs, 1, memory_order_acq_rel) == 1) free(obj);
+}
+
+/**
+ * Drops a reference the conn module was holding.
+ */
+void unref_object(void *obj) {
+    put_object(obj);
+}
+
+/**
+ * 32-bit FNV-1a hash, used to skip string compares in the L1.
+ */
+unsigned fnv1a(const char *s) {
+    unsigned h = 2166136261u;
 
-    P(&mutex); // Lock to decrement readcnt.
-    readcnt--;
-    if (readcnt == 0) V(&w); // Last reader releases writer lock.
-    V(&mutex); // Unlock after decrementing readcnt.
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
 
-    return in_cache; // Return cache status.
+/**
+ * Takes the writers' mutex. A writer that died holding it can only have
+ * left a slot half filled, which no line points to yet, so the mutex is
+ * simply made usable again.
+ */
+void cache_lock() {
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        alog_msg("cache: a process died while writing, recovered");
+        pthread_mutex_consistent(&cache->lock);
+    }
 }
+
 /**
- * Writer function in the reader-writer model.
- * Writes or updates cache entries based on LRU (Least Recently Used) policy.
+ * Writer function.
+ * Fills the free slot its line let go of longest ago with the object for
+ * 'uri', then points the least recently used line at it. The slot that
+ * line pointed to becomes free; its generation moves on, so copies of it
+ * in L1s are dropped when next looked at.
  */
-void writer(char *uri, char *buf, int size) {
-    P(&w); // Acquire exclusive write access.
+void writer(char *uri, char *buf, int size, int hdr_size, int has_length) {
+    int name_len = strlen(uri) + 1, inuse[CACHE_SLOTS] = { 0 }, line = 0, s = -1, old;
+    char *base = (char *)cache;
+    CacheSlot *slot;
+    unsigned gen;
+
+    if (size > MAX_OBJECT_SIZE || name_len > MAXLINE) return;
+    cache_lock(); // Acquire exclusive write access.
 
     // Implement LRU policy to find the least recently used cache line.
-    int least_used_index = 0;
-    int least_used_count = cache.objects[0].used_cnt;
-    for (int i = 1; i < 10; i++) {
-        if (cache.objects[i].used_cnt < least_used_count) {
-            least_used_count = cache.objects[i].used_cnt;
-            least_used_index = i;
-        }
+    for (int i = 0; i < CACHE_LINES; i++) {
+        if ((old = atomic_load(&cache->lines[i].slot)) > 0) inuse[old - 1] = 1;
+        if (cache->lines[i].used_cnt < cache->lines[line].used_cnt) line = i;
+    }
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        if (!inuse[i] && (s < 0 || cache->slots[i].freed < cache->slots[s].freed)) s = i;
     }
 
-    // Update the used count for LRU tracking.
-    cache.objects[least_used_index].used_cnt = ++least_used_count;
-    strcpy(cache.objects[least_used_index].name, uri); // Update the name.
-    memcpy(cache.objects[least_used_index].object, buf, size); // Copy the object data.
+    // Fill the slot, with its generation odd meanwhile.
+    slot = &cache->slots[s];
+    gen = atomic_load_explicit(&slot->gen, memory_order_relaxed) | 1;
+    atomic_store_explicit(&slot->gen, gen, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(base + slot->off, buf, size);
+    memcpy(base + slot->off + size, uri, name_len);
+    slot->hash = fnv1a(uri);
+    slot->size = size;
+    slot->hdr_size = hdr_size;
+    slot->has_length = has_length;
+    slot->name_len = name_len;
+    atomic_store_explicit(&slot->hits, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->gen, gen + 1, memory_order_release);
 
-    V(&w); // Release exclusive write access.
-}
\ No newline at end of file
+    // Publish it, and let go of what the line held.
+    cache->lines[line].used_cnt = ++cache->clock;
+    if ((old = atomic_exchange(&cache->lines[line].slot, s + 1)) > 0) {
+        cache->slots[old - 1].freed = cache->clock;
+        atomic_fetch_add(&cache->slots[old - 1].gen, 2);
+    }
+
+    pthread_mutex_unlock(&cache->lock); // Release exclusive write access.
+}
@@ -36,6 +36,19 @@ void sbuf_insert(sbuf_t *sp, int item)
 }
 /* $end sbuf_insert */
 
+/* Insert item onto the rear of shared buffer sp without waiting.
+ * Returns 1 on success, 0 if every slot is taken. */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    if (sem_trywait(&sp->slots) < 0)        /* No slot: caller sheds load */
+        return 0;
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+    return 1;
+}
+
 /* Remove and return the first item from buffer sp */
 /* $begin sbuf_remove */
 int sbuf_remove(sbuf_t *sp)
@@ -774,39 +774,234 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/* 
+ * Ring buffer layout: the rio_cnt unread bytes start at rio_bufptr and
+ * may wrap around the end of rio_buf back to its start. rio_fillb()
+ * refills both free segments with a single readv(), and the buffer is
+ * grown (up to RIO_MAXBUFSIZE) when a line does not fit in it.
+ */
+
+/* rio_seg - length of the contiguous unread run starting at rio_bufptr */
+static size_t rio_seg(rio_t *rp)
+{
+    size_t to_end = rp->rio_buf + rp->rio_size - rp->rio_bufptr;
+
+    return (size_t)rp->rio_cnt < to_end ? (size_t)rp->rio_cnt : to_end;
+}
+
+/*
+ * rio_relocate - move the unread bytes, unwrapped, to the start of a
+ *    buffer of newsize bytes (which may be the current one)
+ */
+static int rio_relocate(rio_t *rp, size_t newsize)
+{
+    size_t a = rio_seg(rp), b = rp->rio_cnt - a;
+    char *newbuf = rp->rio_buf, *tmp = NULL;
+
+    if (newsize != rp->rio_size && (newbuf = malloc(newsize)) == NULL)
+        return -1;
+    if (newbuf != rp->rio_buf) {
+        memcpy(newbuf, rp->rio_bufptr, a);
+        memcpy(newbuf + a, rp->rio_buf, b);
+        if (rp->rio_buf != rp->rio_inline)
+            free(rp->rio_buf);
+    }
+    else if (b > 0) { /* Rotate in place, saving the smaller segment */
+        if ((tmp = malloc(a < b ? a : b)) == NULL)
+            return -1;
+        if (b <= a) {
+            memcpy(tmp, rp->rio_buf, b);
+            memmove(rp->rio_buf, rp->rio_bufptr, a);
+            memcpy(rp->rio_buf + a, tmp, b);
+        }
+        else {
+            memcpy(tmp, rp->rio_bufptr, a);
+            memmove(rp->rio_buf + a, rp->rio_buf, b);
+            memcpy(rp->rio_buf, tmp, a);
+        }
+        free(tmp);
+    }
+    else
+        memmove(newbuf, rp->rio_bufptr, a);
+    rp->rio_buf = rp->rio_bufptr = newbuf;
+    rp->rio_size = newsize;
+    return 0;
+}
+
+/*
+ * rio_fillb - Read once from the descriptor into all free space of the
+ *    internal buffer, growing it first if it is full. Returns the number
+ *    of bytes added, 0 on EOF, -1 on error (errno set, EAGAIN included
+ *    for non-blocking descriptors)
+ */
+/* $begin rio_fillb */
+ssize_t rio_fillb(rio_t *rp)
+{
+    struct iovec iov[2];
+    char *end = rp->rio_buf + rp->rio_size, *tail;
+    int iovcnt = 1;
+    ssize_t n;
+
+    if (rp->rio_cnt == 0)        /* Empty: restart at the front */
+        rp->rio_bufptr = rp->rio_buf;
+    if ((size_t)rp->rio_cnt == rp->rio_size) {
+        if (rp->rio_size >= RIO_MAXBUFSIZE) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        if (rio_relocate(rp, 2 * rp->rio_size) < 0)
+            return -1;
+        end = rp->rio_buf + rp->rio_size;
+    }
+
+    tail = rp->rio_bufptr + rp->rio_cnt;
+    if (tail >= end)             /* Unread data wraps: one free segment */
+        tail -= rp->rio_size;
+    if (tail < rp->rio_bufptr) {
+        iov[0].iov_base = tail;
+        iov[0].iov_len = rp->rio_bufptr - tail;
+    }
+    else {                       /* Free space after the data and before it */
+        iov[0].iov_base = tail;
+        iov[0].iov_len = end - tail;
+        iov[1].iov_base = rp->rio_buf;
+        iov[1].iov_len = rp->rio_bufptr - rp->rio_buf;
+        iovcnt = iov[1].iov_len > 0 ? 2 : 1;
+    }
+
+    while ((n = readv(rp->rio_fd, iov, iovcnt)) < 0)
+        if (errno != EINTR) /* Interrupted by sig handler return */
+            return -1;
+    rp->rio_cnt += n;
+    return n;
+}
+/* $end rio_fillb */
+
+/*
+ * rio_peek - Return a view of the longest contiguous run of unread bytes
+ *    in *bufp, refilling first if nothing is buffered. Returns its
+ *    length, 0 on EOF and -1 on error. Nothing is consumed
+ */
+/* $begin rio_peek */
+ssize_t rio_peek(rio_t *rp, char **bufp)
+{
+    ssize_t n;
+
+    if (rp->rio_cnt == 0 && (n = rio_fillb(rp)) <= 0)
+        return n;
+    *bufp = rp->rio_bufptr;
+    return rio_seg(rp);
+}
+/* $end rio_peek */
+
+/*
+ * rio_consume - Discard n bytes previously returned by rio_peek or
+ *    rio_peekline
+ */
+/* $begin rio_consume */
+void rio_consume(rio_t *rp, size_t n)
+{
+    rp->rio_cnt -= n;
+    rp->rio_bufptr += n;
+    if (rp->rio_bufptr >= rp->rio_buf + rp->rio_size)
+        rp->rio_bufptr -= rp->rio_size;
+    if (rp->rio_cnt == 0)
+        rp->rio_bufptr = rp->rio_buf;
+}
+/* $end rio_consume */
+
+/*
+ * rio_findline - Buffer input until the next line is complete, limit
+ *    bytes are buffered, or EOF. Returns the length of the line
+ *    (including its '\n') or of the partial line, 0 on EOF and -1 on
+ *    error. The returned span is made contiguous at rio_bufptr
+ */
+static ssize_t rio_findline(rio_t *rp, size_t limit)
+{
+    size_t scanned = 0, len;
+    ssize_t n;
+    char *p, *nl;
+
+    while (1) {
+        /* Only look at bytes not scanned on a previous pass */
+        while (scanned < (size_t)rp->rio_cnt && scanned < limit) {
+            p = rp->rio_bufptr + scanned;
+            if (p >= rp->rio_buf + rp->rio_size)
+                p -= rp->rio_size;
+            len = rp->rio_buf + rp->rio_size - p;
+            if (len > rp->rio_cnt - scanned)
+                len = rp->rio_cnt - scanned;
+            if (len > limit - scanned)
+                len = limit - scanned;
+            if ((nl = memchr(p, '\n', len)) != NULL) {
+                len = scanned + (nl - p) + 1;
+                goto found;
+            }
+            scanned += len;
+        }
+        if (scanned >= limit) {
+            len = limit;
+            goto found;
+        }
+        if ((n = rio_fillb(rp)) < 0) {
+            if (errno != ENOBUFS)
+                return -1;
+            len = rp->rio_cnt;   /* Line longer than RIO_MAXBUFSIZE */
+            goto found;
+        }
+        if (n == 0) {            /* EOF */
+            len = rp->rio_cnt;
+            goto found;
+        }
+    }
+
+ found:
+    if (len > rio_seg(rp) && rio_relocate(rp, rp->rio_size) < 0)
+        return -1;
+    return len;
+}
+
+/*
+ * rio_peekline - Return in *linep a view of the next text line, without
+ *    copying it. Returns the line length including '\n' (or the length
+ *    of a final unterminated line), 0 on EOF and -1 on error. The line
+ *    stays buffered until rio_consume() is called
+ */
+/* $begin rio_peekline */
+ssize_t rio_peekline(rio_t *rp, char **linep)
+{
+    ssize_t n;
+
+    if ((n = rio_findline(rp, RIO_MAXBUFSIZE)) > 0)
+        *linep = rp->rio_bufptr;
+    return n;
+}
+/* $end rio_peekline */
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    readv() if the internal buffer is empty.
  */
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
-    int cnt;
+    size_t cnt;
+    char *p;
+    ssize_t rc;
 
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
+    if ((rc = rio_peek(rp, &p)) <= 0)
+        return rc;
 
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;          
-    if (rp->rio_cnt < n)   
-	cnt = rp->rio_cnt;
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
+    /* Copy min(n, contiguous unread bytes) from internal buf to user buf */
+    cnt = n;
+    if ((size_t)rc < n)
+        cnt = rc;
+    memcpy(usrbuf, p, cnt);
+    rio_consume(rp, cnt);
     return cnt;
 }
 /* $end rio_read */
@@ -815,64 +1010,72 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 /* $begin rio_readinitb */
-void rio_readinitb(rio_t *rp, int fd) 
+void rio_readinitb(rio_t *rp, int fd)
 {
-    rp->rio_fd = fd;  
-    rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
+    rp->rio_buf = rp->rio_bufptr = rp->rio_inline;
+    rp->rio_size = RIO_BUFSIZE;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_freeb - Release a buffer that grew beyond its initial storage
+ */
+/* $begin rio_freeb */
+void rio_freeb(rio_t *rp)
+{
+    if (rp->rio_buf != rp->rio_inline)
+        free(rp->rio_buf);
+    rio_readinitb(rp, rp->rio_fd);
+}
+/* $end rio_freeb */
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
 /* $begin rio_readnb */
-ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) 
+ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 {
     size_t nleft = n;
     ssize_t nread;
     char *bufp = usrbuf;
-    
+
     while (nleft > 0) {
-	if ((nread = rio_read(rp, bufp, nleft)) < 0) 
-            return -1;          /* errno set by read() */ 
-	else if (nread == 0)
-	    break;              /* EOF */
-	nleft -= nread;
-	bufp += nread;
+        if (rp->rio_cnt == 0 && nleft >= rp->rio_size) { /* Bypass the buffer */
+            if ((nread = read(rp->rio_fd, bufp, nleft)) < 0 && errno == EINTR)
+                continue; /* Interrupted by sig handler return */
+        }
+        else
+            nread = rio_read(rp, bufp, nleft);
+        if (nread < 0)
+            return -1; /* errno set by read() */
+        else if (nread == 0)
+            break; /* EOF */
+        nleft -= nread;
+        bufp += nread;
     }
-    return (n - nleft);         /* return >= 0 */
+    return (n - nleft); /* return >= 0 */
 }
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The line is
+ *    located with memchr over the buffered bytes and copied once
  */
 /* $begin rio_readlineb */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    ssize_t n;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1) {
-		return 0; /* EOF, no data read */
-            }
-	    else {
-		break;    /* EOF, some data was read */
-            }
-	} else
-	    return -1;	  /* Error */
-    }
-    *bufp = '\0';
-    return n-1;
+    if (maxlen == 0)
+        return 0;
+    if ((n = rio_findline(rp, maxlen - 1)) < 0)
+        return -1; /* Error */
+    memcpy(usrbuf, rp->rio_bufptr, n);
+    rio_consume(rp, n);
+    ((char *)usrbuf)[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
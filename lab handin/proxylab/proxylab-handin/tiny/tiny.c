@@ -1,16 +1,62 @@
 /* $begin tinymain */
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ *     GET method to serve static and dynamic content. Persistent
+ *     connections are supported, so pipelined requests are answered
+ *     in order straight out of the connection's read buffer.
  */
+#define _XOPEN_SOURCE 700   /* strptime */
+#define _DEFAULT_SOURCE     /* timegm, index */
 #include "csapp.h"
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp, char *req_header_buf);
+/* splice(2) flags; <fcntl.h> only exposes them under _GNU_SOURCE, which
+ * clashes with csapp.h's gai_error(), so we call splice via syscall() */
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+
+/* How long an idle persistent connection may hold the accept loop */
+#define KEEPALIVE_MS 200
+
+/* Room for make_etag's "ino-size-mtime", http_date's IMF-fixdate and
+ * get_filetype's MIME types, so the response headers fit in MAXBUF */
+#define ETAGLEN 64
+#define DATELEN 32
+#define TYPELEN 32
+
+/* Log connections, request lines and headers to stdout (-v); off by
+ * default so neither reverse lookups nor logging sit on the request path */
+static int verbose;
+
+/* The listening socket, which CGI relay children close, and whether this
+ * process is such a child (it then relays CGI output without forking) */
+static int listenfd = -1, relay_child;
+
+void serve_conn(int fd, rio_t *rp);
+int doit(int fd, rio_t *rp);
+int read_requesthdrs(rio_t *rp, char *req_header_buf, size_t size);
+int wants_keepalive(char *version, char *headers);
+int get_header(char *headers, char *name, char *value);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+int serve_static(int fd, char *filename, struct stat *sbuf, char *headers,
+                 char *version, int keepalive);
+int parse_range(char *range, off_t filesize, off_t *start, off_t *end);
+int not_modified(char *headers, char *etag, time_t mtime);
+int if_range_match(char *headers, char *etag, time_t mtime);
+void make_etag(struct stat *sbuf, char *etag);
+void http_date(time_t t, char *buf);
+time_t parse_http_date(char *buf);
 void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs, char *headers);
+int serve_dynamic(int fd, rio_t *rp, char *filename, char *cgiargs, char *headers,
+                  char *version, int keepalive);
+int relay_cgi(int fd, char *filename, char *cgiargs, char *headers, int chunked_ok,
+              int keepalive);
+ssize_t relay_bytes(int in, int out, size_t len);
+ssize_t write_chunk(int out, int in, char *buf, size_t len);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
@@ -25,104 +71,201 @@ int main(int argc, char **argv)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, sigchld_handler);
 
-    int listenfd, connfd;
+    int connfd;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    rio_t rio;
+    int opt;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "v")) == 'v')
+	verbose = 1;
+    if (opt != -1 || argc - optind != 1) {
+	fprintf(stderr, "usage: %s [-v] <port>\n", argv[0]);
 	exit(1);
     }
 
-    listenfd = open_listenfd(argv[1]);
+    listenfd = open_listenfd(argv[optind]);
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
-        getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
+        if (verbose) {
+            getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+                        port, MAXLINE, 0);
+            printf("Accepted connection from (%s, %s)\n", hostname, port);
+        }
+	rio_readinitb(&rio, connfd);
+	serve_conn(connfd, &rio);                                 //line:netp:tiny:doit
+	rio_freeb(&rio);
 	close(connfd);                                            //line:netp:tiny:close
     }
 }
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * serve_conn - answer requests on a connection until the client asks to
+ *     close it or goes idle. Pipelined requests are already sitting in
+ *     the rio buffer, so they are served without waiting on the socket
+ */
+void serve_conn(int fd, rio_t *rp)
+{
+    struct pollfd pf = { fd, POLLIN, 0 };
+
+    while (doit(fd, rp)) {
+        if (rp->rio_cnt <= 0 && poll(&pf, 1, KEEPALIVE_MS) <= 0)
+            break;
+    }
+}
+
+/*
+ * doit - handle one HTTP request/response transaction. Return 1 if the
+ *     connection may carry another request, 0 if it must be closed here
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rp) 
 {
-    int is_static;
+    int is_static, keepalive;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    char req_header_buf[MAXLINE];
-    rio_t rio;
+    char req_header_buf[MAXBUF];
 
-    /* Read request line and headers */
-    rio_readinitb(&rio, fd);
-    if (!rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
+    /* Read request line and headers, skipping blank lines between requests */
+    do {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0)  //line:netp:doit:readrequest
+            return 0;
+    } while (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"));
+    if (verbose)
+        printf("%s", buf);
+    version[0] = '\0';
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return 0;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio, req_header_buf);              //line:netp:doit:readrequesthdrs
+    if (read_requesthdrs(rp, req_header_buf, sizeof(req_header_buf)) < 0) //line:netp:doit:readrequesthdrs
+        return 0;
+    keepalive = wants_keepalive(version, req_header_buf);
+    if (strcasecmp(version, "HTTP/1.1"))
+        strcpy(version, "HTTP/1.0");
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
 	clienterror(fd, filename, "404", "Not found",
 		    "Tiny couldn't find this file");
-	return;
+	return 0;
     }                                                    //line:netp:doit:endnotfound
 
     if (is_static) { /* Serve static content */          
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't read the file");
-	    return;
+	    return 0;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	return serve_static(fd, filename, &sbuf, req_header_buf, version, keepalive); //line:netp:doit:servestatic
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't run the CGI program");
-	    return;
+	    return 0;
 	}
-	serve_dynamic(fd, filename, cgiargs, req_header_buf);//line:netp:doit:servedynamic
+	return serve_dynamic(fd, rp, filename, cgiargs, req_header_buf, version, keepalive);//line:netp:doit:servedynamic
     }
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers into req_header_buf,
+ *     dropping lines that would overflow its size bytes. Lines are
+ *     taken as views into the rio buffer, so each is copied only once.
+ *     Any request body announced by Content-Length is skipped so that
+ *     the next pipelined request starts at the right place. Return -1
+ *     on EOF
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp, char *req_header_buf) 
+int read_requesthdrs(rio_t *rp, char *req_header_buf, size_t size) 
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *line;
+    size_t used = 0;
+    ssize_t n;
+    long long body;
+    int last;
+
     req_header_buf[0]='\0';
+    do {
+        if ((n = rio_peekline(rp, &line)) <= 0)
+            return -1;
+        if (verbose)
+            fwrite(line, 1, n, stdout);
+        last = (n == 2 && line[0] == '\r') || (n == 1 && line[0] == '\n'); //line:netp:readhdrs:checkterm
+        if (used + n < size) {
+            memcpy(req_header_buf + used, line, n);
+            used += n;
+            req_header_buf[used] = '\0';
+        }
+        rio_consume(rp, n);
+    } while (!last);
 
-    rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    strcat(req_header_buf, buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-        rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
-        strcat(req_header_buf, buf);
+    if (get_header(req_header_buf, "Content-Length", buf)) {
+        for (body = atoll(buf); body > 0; body -= n)
+            if ((n = rio_readnb(rp, buf, body < MAXLINE ? body : MAXLINE)) <= 0)
+                return -1;
     }
-    return;
+    return 0;
 }
 /* $end read_requesthdrs */
 
+/*
+ * wants_keepalive - HTTP/1.1 connections persist unless the client sends
+ *     "Connection: close"; HTTP/1.0 ones only on "Connection: keep-alive"
+ */
+int wants_keepalive(char *version, char *headers)
+{
+    char value[MAXLINE], *p;
+    int keepalive = !strcasecmp(version, "HTTP/1.1");
+
+    if (get_header(headers, "Connection", value)) {
+        for (p = value; *p; p++)
+            *p = tolower(*p);
+        if (strstr(value, "close"))
+            keepalive = 0;
+        else if (strstr(value, "keep-alive"))
+            keepalive = 1;
+    }
+    return keepalive;
+}
+
+/*
+ * get_header - look up header 'name' in the raw request headers and
+ *              copy its value into 'value'. Return 1 if found, 0 otherwise
+ */
+int get_header(char *headers, char *name, char *value)
+{
+    size_t len = strlen(name), n;
+    char *line = headers, *end, *p;
+
+    while (*line) {
+        end = strstr(line, "\r\n");
+        if (!strncasecmp(line, name, len) && line[len] == ':') {
+            p = line + len + 1;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            n = end ? (size_t)(end - p) : strlen(p);
+            memcpy(value, p, n);
+            value[n] = '\0';
+            return 1;
+        }
+        if (!end)
+            break;
+        line = end + 2;
+    }
+    return 0;
+}
+
 /*
  * parse_uri - parse URI into filename and CGI args
  *             return 0 if dynamic content, 1 if static
@@ -156,36 +299,207 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file (or the requested byte range of it) back
+ *     to the client, answering conditional requests with 304. The file
+ *     is mapped before any header is sent, so a file that cannot be
+ *     read still gets an error response. Return like doit
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+int serve_static(int fd, char *filename, struct stat *sbuf, char *headers,
+                 char *version, int keepalive) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    int srcfd, partial = 0;
+    off_t filesize = sbuf->st_size, start = 0, end = filesize - 1, mapoff = 0;
+    size_t len;
+    char *srcp = NULL, filetype[TYPELEN], buf[MAXBUF];
+    char etag[ETAGLEN], lastmod[DATELEN], range[MAXLINE];
+
+    make_etag(sbuf, etag);
+    http_date(sbuf->st_mtime, lastmod);
+
+    /* Revalidation: the client already holds this version */
+    if (not_modified(headers, etag, sbuf->st_mtime)) {
+        sprintf(buf, "%s 304 Not Modified\r\n", version);
+        sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+        sprintf(buf + strlen(buf), "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+        sprintf(buf + strlen(buf), "ETag: %s\r\n", etag);
+        sprintf(buf + strlen(buf), "Last-Modified: %s\r\n", lastmod);
+        sprintf(buf + strlen(buf), "Cache-Control: no-cache\r\n\r\n");
+        rio_writen(fd, buf, strlen(buf));
+        return keepalive;
+    }
+
+    /* A Range only applies if If-Range (when present) still matches */
+    if (get_header(headers, "Range", range) && if_range_match(headers, etag, sbuf->st_mtime)) {
+        partial = parse_range(range, filesize, &start, &end);
+        if (partial < 0) {
+            sprintf(buf, "%s 416 Range Not Satisfiable\r\n", version);
+            sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+            sprintf(buf + strlen(buf), "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+            sprintf(buf + strlen(buf), "Content-Range: bytes */%lld\r\n", (long long)filesize);
+            sprintf(buf + strlen(buf), "Content-length: 0\r\n\r\n");
+            rio_writen(fd, buf, strlen(buf));
+            return keepalive;
+        }
+    }
+    len = end - start + 1;
+
+    /* Map only the requested pages of the file */
+    if (filesize > 0) {
+        mapoff = start & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        if ((srcfd = open(filename, O_RDONLY, 0)) < 0) { //line:netp:servestatic:open
+            clienterror(fd, filename, "403", "Forbidden",
+                        "Tiny couldn't read the file");
+            return 0;
+        }
+        srcp = mmap(0, end + 1 - mapoff, PROT_READ, MAP_PRIVATE, srcfd, mapoff);//line:netp:servestatic:mmap
+        close(srcfd);                       //line:netp:servestatic:close
+        if (srcp == MAP_FAILED) {
+            clienterror(fd, filename, "500", "Internal Server Error",
+                        "Tiny couldn't map the file");
+            return 0;
+        }
+    }
  
     /* Send response headers to client */
     get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-overflow"
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sVary: *\r\n", buf);
-    sprintf(buf, "%sCache-Control: no-cache, no-store, must-revalidate\r\n", buf);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-#pragma GCC diagnostic pop
+    if (partial)
+        sprintf(buf, "%s 206 Partial Content\r\n", version);
+    else
+        sprintf(buf, "%s 200 OK\r\n", version); //line:netp:servestatic:beginserve
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+    sprintf(buf + strlen(buf), "Content-length: %lld\r\n", (long long)len);
+    if (partial)
+        sprintf(buf + strlen(buf), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                (long long)start, (long long)end, (long long)filesize);
+    sprintf(buf + strlen(buf), "Accept-Ranges: bytes\r\n");
+    sprintf(buf + strlen(buf), "ETag: %s\r\n", etag);
+    sprintf(buf + strlen(buf), "Last-Modified: %s\r\n", lastmod);
+    sprintf(buf + strlen(buf), "Cache-Control: no-cache\r\n");
+    sprintf(buf + strlen(buf), "Content-type: %s\r\n\r\n", filetype);
     rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
-    printf("Response headers:\n");
-    printf("%s", buf);
+    if (verbose) {
+        printf("Response headers:\n");
+        printf("%s", buf);
+    }
+
+    if (filesize == 0)
+        return keepalive;
 
     /* Send response body to client */
-    srcfd = open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
-    close(srcfd);                           //line:netp:servestatic:close
-    rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
-    munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    rio_writen(fd, srcp + (start - mapoff), len); //line:netp:servestatic:write
+    munmap(srcp, end + 1 - mapoff);         //line:netp:servestatic:munmap
+    return keepalive;
+}
+
+/*
+ * parse_range - parse a single "bytes=" range for a file of filesize
+ *     bytes into the inclusive span [*start, *end]. Return 1 for a
+ *     usable range, 0 if the header should be ignored (malformed or
+ *     multi-range, so the whole file is sent) and -1 if unsatisfiable
+ */
+int parse_range(char *range, off_t filesize, off_t *start, off_t *end)
+{
+    char *p, *q;
+    long long first, last;
+
+    if (strncasecmp(range, "bytes=", 6) || strchr(range, ','))
+        return 0;
+    p = range + 6;
+    if (*p == '-') {                        /* Suffix range: last N bytes */
+        last = strtoll(p + 1, &q, 10);
+        if (q == p + 1 || last < 0)
+            return 0;
+        if (last == 0 || filesize == 0)
+            return -1;
+        *start = last >= filesize ? 0 : filesize - last;
+        *end = filesize - 1;
+        return 1;
+    }
+    first = strtoll(p, &q, 10);
+    if (q == p || *q != '-' || first < 0)
+        return 0;
+    p = q + 1;
+    if (*p == '\0')
+        last = filesize - 1;
+    else {
+        last = strtoll(p, &q, 10);
+        if (q == p || last < first)
+            return 0;
+    }
+    if (first >= filesize)
+        return -1;
+    *start = first;
+    *end = last >= filesize ? filesize - 1 : last;
+    return 1;
+}
+
+/*
+ * not_modified - return 1 if the conditional headers show that the
+ *     client's copy is current. If-None-Match takes precedence over
+ *     If-Modified-Since
+ */
+int not_modified(char *headers, char *etag, time_t mtime)
+{
+    char value[MAXLINE];
+    time_t since;
+
+    if (get_header(headers, "If-None-Match", value))
+        return !strcmp(value, "*") || strstr(value, etag) != NULL;
+    if (get_header(headers, "If-Modified-Since", value)) {
+        since = parse_http_date(value);
+        return since != (time_t)-1 && mtime <= since;
+    }
+    return 0;
+}
+
+/*
+ * if_range_match - return 1 if a Range request should be honoured: either
+ *     there is no If-Range, or it names the current entity tag or date
+ */
+int if_range_match(char *headers, char *etag, time_t mtime)
+{
+    char value[MAXLINE];
+
+    if (!get_header(headers, "If-Range", value))
+        return 1;
+    if (value[0] == '"')
+        return !strcmp(value, etag);
+    return parse_http_date(value) == mtime;
+}
+
+/*
+ * make_etag - derive a strong entity tag from inode, size and mtime
+ */
+void make_etag(struct stat *sbuf, char *etag)
+{
+    sprintf(etag, "\"%lx-%llx-%lx\"", (unsigned long)sbuf->st_ino,
+            (unsigned long long)sbuf->st_size, (unsigned long)sbuf->st_mtime);
+}
+
+/*
+ * http_date - format t as an RFC 7231 IMF-fixdate
+ */
+void http_date(time_t t, char *buf)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, DATELEN, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * parse_http_date - inverse of http_date; return -1 if buf is not a date
+ */
+time_t parse_http_date(char *buf)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return (time_t)-1;
+    return timegm(&tm);
 }
 
 /*
@@ -211,41 +525,193 @@ void get_filetype(char *filename, char *filetype)
 /* $end serve_static */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_dynamic - run a CGI program on behalf of the client. The CGI
+ *     output is relayed by a forked child so that a slow program never
+ *     holds up the accept loop. The child also takes over the rest of a
+ *     persistent connection (its copy of rp holds any pipelined requests),
+ *     which keeps responses in order; the parent always returns 0. Later
+ *     CGI requests on that connection are relayed by the child itself, so
+ *     every CGI program is waited for by relay_cgi and no relay is nested
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs, char *headers) 
+int serve_dynamic(int fd, rio_t *rp, char *filename, char *cgiargs, char *headers,
+                  char *version, int keepalive) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    int pid, chunked_ok = !strcasecmp(version, "HTTP/1.1");
 
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    sprintf(buf, "%sVary: *\r\n", buf);
-    sprintf(buf, "%sCache-Control: no-cache, no-store, must-revalidate\r\n", buf);
-    rio_writen(fd, buf, strlen(buf));
-  
-    int pid = fork();
-    
-    if (pid < 0) {
+    if (relay_child)
+        return relay_cgi(fd, filename, cgiargs, headers, chunked_ok, keepalive);
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Tiny failed to fork CGI relay!\n");
+        return 0;
+    }
+    if (pid > 0)  /* Parent: sigchld_handler reaps the relay */
+        return 0;
+
+    /* Relay child: wait for the CGI program ourselves. A SIGCHLD handler
+     * would reap it first and interrupt the relay's poll and splice */
+    signal(SIGCHLD, SIG_DFL);
+    close(listenfd);
+    relay_child = 1;
+    if (relay_cgi(fd, filename, cgiargs, headers, chunked_ok, keepalive))
+        serve_conn(fd, rp);
+    exit(0);
+}
+
+/*
+ * relay_cgi - run the CGI program with its stdout on a pipe and frame
+ *     its output for the client: the CGI's own Content-Length is kept
+ *     when present, otherwise HTTP/1.1 clients get chunked encoding and
+ *     HTTP/1.0 clients a close-delimited body. Return 1 if the connection
+ *     can carry another request afterwards
+ */
+int relay_cgi(int fd, char *filename, char *cgiargs, char *headers, int chunked_ok,
+              int keepalive)
+{
+    char buf[MAXBUF], line[MAXLINE], cgihdrs[MAXBUF], *emptylist[] = { NULL }, *p;
+    int pfd[2], pid, chunked, ready;
+    long long clen = -1, total = 0;
+    ssize_t n;
+    size_t left = 0;
+    rio_t rio;
+
+    if (pipe(pfd) < 0) {
+        fprintf(stderr, "Tiny failed to create CGI pipe!\n");
+        return 0;
+    }
+    if ((pid = fork()) < 0) {
         fprintf(stderr, "Tiny failed to fork CGI process!\n");
-        return;
+        return 0;
     }
-  
     if (pid == 0) { /* Child */ //line:netp:servedynamic:fork
         /* Real server would set all CGI vars here */
+        close(pfd[0]);
         setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
         setenv("REQUEST_HEADERS", headers, 1);
-        dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
+        dup2(pfd[1], STDOUT_FILENO);     /* Redirect stdout to the relay pipe */ //line:netp:servedynamic:dup2
+        close(pfd[1]);
         execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
-    } else {
-        // change in proxylab:
-        // parent do not wait for /cgi-bin/repeater
-        // allowing it to run in the background
-        if(strstr(filename, "repeater")==NULL)
-            wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+        exit(1);
+    }
+    close(pfd[1]);
+
+    /* Collect the header block the CGI program prints before its body */
+    cgihdrs[0] = '\0';
+    rio_readinitb(&rio, pfd[0]);
+    while ((n = rio_readlineb(&rio, line, MAXLINE)) > 0) {
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+        if (!strncasecmp(line, "Connection:", 11))
+            continue;                       /* We decide the framing */
+        if (!strncasecmp(line, "Content-length:", 15))
+            clen = atoll(line + 15);
+        if (strlen(cgihdrs) + n < MAXBUF)
+            strcat(cgihdrs, line);
+    }
+    chunked = clen < 0 && chunked_ok;
+    keepalive = keepalive && (clen >= 0 || chunked);
+
+    /* Return the response headers */
+    sprintf(buf, "%s 200 OK\r\n", chunked_ok ? "HTTP/1.1" : "HTTP/1.0");
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+    sprintf(buf + strlen(buf), "Vary: *\r\n");
+    sprintf(buf + strlen(buf), "Cache-Control: no-cache, no-store, must-revalidate\r\n");
+    if (chunked)
+        sprintf(buf + strlen(buf), "Transfer-Encoding: chunked\r\n");
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, cgihdrs, strlen(cgihdrs));
+    rio_writen(fd, "\r\n", 2);
+
+    /* Body bytes that were read along with the CGI headers go first */
+    if (clen >= 0)
+        left = clen;
+    while (rio.rio_cnt > 0 && (clen < 0 || left > 0)) {
+        n = rio_peek(&rio, &p);
+        if (clen >= 0 && (size_t)n > left)
+            n = left;
+        if (chunked)
+            write_chunk(fd, -1, p, n);
+        else
+            rio_writen(fd, p, n);
+        rio_consume(&rio, n);
+        total += n;
+        left -= clen >= 0 ? n : 0;
+    }
+    rio_freeb(&rio);
+
+    /* Then move the rest pipe-to-socket without copying through tiny */
+    while (clen < 0 || left > 0) {
+        if (chunked) {
+            /* Frame whatever the CGI has flushed so far as one chunk */
+            struct pollfd pf = { pfd[0], POLLIN, 0 };
+            if (poll(&pf, 1, -1) < 0 || ioctl(pfd[0], FIONREAD, &ready) < 0 || ready == 0)
+                break;
+            if ((n = write_chunk(fd, pfd[0], NULL, ready)) <= 0)
+                break;
+        }
+        else if ((n = relay_bytes(pfd[0], fd, clen >= 0 ? left : MAXBUF)) <= 0)
+            break;
+        total += n;
+        if (clen >= 0)
+            left -= n;
     }
+    if (chunked)
+        rio_writen(fd, "0\r\n\r\n", 5);
+
+    close(pfd[0]);
+    waitpid(pid, NULL, 0);
+    if (verbose)
+        printf("CGI %s relayed %lld body bytes%s\n", filename, total,
+               chunked ? " (chunked)" : "");
+    return keepalive && (clen < 0 || left == 0);
+}
+
+/*
+ * write_chunk - send len bytes as one chunk of a chunked body, taken
+ *     from buf when it is non-NULL and spliced from pipe 'in' otherwise
+ */
+ssize_t write_chunk(int out, int in, char *buf, size_t len)
+{
+    char hdr[32];
+    size_t done = 0;
+    ssize_t n;
+
+    sprintf(hdr, "%zx\r\n", len);
+    if (rio_writen(out, hdr, strlen(hdr)) < 0)
+        return -1;
+    if (buf) {
+        if (rio_writen(out, buf, len) < 0)
+            return -1;
+        done = len;
+    }
+    while (done < len) {
+        if ((n = relay_bytes(in, out, len - done)) <= 0)
+            return -1;
+        done += n;
+    }
+    if (rio_writen(out, "\r\n", 2) < 0)
+        return -1;
+    return done;
+}
+
+/*
+ * relay_bytes - move up to len bytes from pipe 'in' to socket 'out' with
+ *     splice(2), falling back to read/write where splice is unsupported.
+ *     Returns the number of bytes moved, 0 on EOF and -1 on error
+ */
+ssize_t relay_bytes(int in, int out, size_t len)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+
+    n = syscall(SYS_splice, in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n >= 0 || errno != EINVAL)
+        return n;
+    if ((n = read(in, buf, len < MAXBUF ? len : MAXBUF)) <= 0)
+        return n;
+    return rio_writen(out, buf, n);
 }
 /* $end serve_dynamic */
 
@@ -258,19 +724,19 @@ void clienterror(int fd, char *cause, char *errnum,
 {
     char buf[MAXLINE], body[MAXBUF];
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-overflow"
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-#pragma GCC diagnostic pop
+    snprintf(body, MAXBUF, "<html><title>Tiny Error</title>"
+             "<body bgcolor=""ffffff"">\r\n"
+             "%s: %s\r\n"
+             "<p>%s: %s\r\n"
+             "<hr><em>The Tiny Web server</em>\r\n",
+             errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
     rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Connection: close\r\n");
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-type: text/html\r\n");
     rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
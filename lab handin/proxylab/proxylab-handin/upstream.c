@@ -0,0 +1,755 @@
+/*
+ * upstream.c - origin selection, health checking and parallel connect
+ * (see upstream.h)
+ */
+#include "csapp.h"
+#include "upstream.h"
+#include "deadline.h"
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
+
+enum { UPS_ROUND_ROBIN, UPS_LEAST_CONN, UPS_HASH };
+
+typedef struct {
+    int family, protocol;
+    socklen_t len;
+    struct sockaddr_storage sa;
+} ups_addr_t;
+
+struct ups_server {
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    ups_addr_t addrs[UPS_MAX_ADDRS];
+    int naddrs;
+    _Atomic int active;           /* Connections currently in use */
+    _Atomic int healthy;          /* Result of the last health check */
+    _Atomic int fails;            /* Consecutive failed requests */
+    _Atomic int ejections;        /* Ejections since the last success */
+    _Atomic long long ejected_until; /* CLOCK_MONOTONIC ms */
+    _Atomic long long ewma_us;    /* Smoothed time to response headers */
+};
+
+typedef struct {
+    unsigned hash;
+    int server;
+} ups_point_t;
+
+typedef struct {
+    char name[NI_MAXHOST];
+    char health[NI_MAXHOST];      /* Path to GET, empty for a TCP-only check */
+    int policy;
+    int nservers;
+    ups_server_t servers[UPS_MAX_SERVERS];
+    ups_point_t *ring;            /* UPS_VNODES points per server, sorted */
+    _Atomic unsigned rr;
+} ups_group_t;
+
+/* One loaded config; replaced as a whole by ups_reload() */
+typedef struct ups_table {
+    int ngroups;
+    ups_group_t groups[UPS_MAX_GROUPS];
+    long long retired_ms;         /* When it was replaced */
+    struct ups_table *next;       /* Retired tables */
+} ups_table_t;
+
+static _Atomic(ups_table_t *) table;
+static ups_table_t *retired;      /* Freed by the checker once unused */
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+/* A resolved origin name. An entry being looked up is never replaced */
+typedef struct {
+    char host[NI_MAXHOST], port[NI_MAXSERV]; /* Empty host: unused */
+    ups_addr_t addrs[UPS_MAX_ADDRS];
+    int naddrs;                   /* 0 after a failed lookup */
+    int pending;                  /* A resolver thread is looking it up */
+    long long expires_ms;         /* Look it up again after this */
+    long long used_ms;            /* The least recently used is replaced */
+} dns_entry_t;
+
+static dns_entry_t dns_cache[UPS_DNS_ENTRIES];
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_done;   /* On CLOCK_MONOTONIC, like deadlines */
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+static ups_group_t *peers;        /* Cache peers, this proxy included */
+static int self_peer;             /* Our index in peers */
+static pthread_once_t checker_once = PTHREAD_ONCE_INIT;
+
+static void *ups_checker(void *vargp);
+static void start_checker(void);
+
+/* 32-bit FNV-1a */
+static unsigned fnv1a(const char *s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+/*
+ * resolve - look up host:port into at most max addresses, alternating
+ *    address families as RFC 8305 suggests. Returns the count, 0 on error
+ */
+static int resolve(char *host, char *port, ups_addr_t *addrs, int max)
+{
+    struct addrinfo hints, *list, *p;
+    ups_addr_t first[UPS_MAX_ADDRS], other[UPS_MAX_ADDRS];
+    int nfirst = 0, nother = 0, n = 0, family = AF_UNSPEC, i, j;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &list) != 0)
+        return 0;
+    for (p = list; p; p = p->ai_next) {
+        ups_addr_t *a;
+        if (family == AF_UNSPEC)
+            family = p->ai_family;
+        if (p->ai_family == family && nfirst < max)
+            a = &first[nfirst++];
+        else if (p->ai_family != family && nother < max)
+            a = &other[nother++];
+        else
+            continue;
+        a->family = p->ai_family;
+        a->protocol = p->ai_protocol;
+        a->len = p->ai_addrlen;
+        memcpy(&a->sa, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(list);
+
+    for (i = j = 0; n < max && (i < nfirst || j < nother); ) {
+        if (i < nfirst)
+            addrs[n++] = first[i++];
+        if (j < nother && n < max)
+            addrs[n++] = other[j++];
+    }
+    return n;
+}
+
+static void dns_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dns_done, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* dns_resolver - thread that looks up one entry and wakes its waiters */
+static void *dns_resolver(void *vargp)
+{
+    dns_entry_t *e = vargp;
+    ups_addr_t addrs[UPS_MAX_ADDRS];
+    int n;
+
+    pthread_detach(pthread_self());
+    n = resolve(e->host, e->port, addrs, UPS_MAX_ADDRS);
+    pthread_mutex_lock(&dns_lock);
+    memcpy(e->addrs, addrs, n * sizeof(ups_addr_t));
+    e->naddrs = n;
+    e->expires_ms = dl_now() + (n > 0 ? UPS_DNS_TTL_MS : UPS_DNS_NEG_MS);
+    e->pending = 0;
+    pthread_cond_broadcast(&dns_done);
+    pthread_mutex_unlock(&dns_lock);
+    return NULL;
+}
+
+/*
+ * lookup - resolve host:port through the cache, waiting no later than the
+ *    deadline. A miss is handed to a resolver thread, since getaddrinfo()
+ *    cannot be bounded; one that finishes too late still fills the cache
+ *    for later requests. An expired entry is refreshed the same way, its
+ *    addresses being used meanwhile. Returns the count of addresses, 0
+ *    with errno set if there are none
+ */
+static int lookup(char *host, char *port, ups_addr_t *addrs, int max, long long deadline)
+{
+    dns_entry_t *e, *victim, *d;
+    struct timespec ts;
+    pthread_t tid;
+    long long now;
+    int i, n;
+
+    if (strlen(host) >= NI_MAXHOST || strlen(port) >= NI_MAXSERV) {
+        errno = EHOSTUNREACH;
+        return 0;
+    }
+    pthread_once(&dns_once, dns_init);
+    pthread_mutex_lock(&dns_lock);
+    for (;;) {
+        now = dl_now();
+        for (e = victim = NULL, i = 0; i < UPS_DNS_ENTRIES && !e; i++) {
+            d = &dns_cache[i];
+            if (d->host[0] && !strcasecmp(d->host, host) && !strcmp(d->port, port))
+                e = d;
+            else if (!d->pending && (!victim || d->used_ms < victim->used_ms))
+                victim = d;
+        }
+        if (!e) {
+            if (!(e = victim)) {        /* Every entry is being looked up */
+                pthread_mutex_unlock(&dns_lock);
+                errno = EAGAIN;
+                return 0;
+            }
+            strcpy(e->host, host);
+            strcpy(e->port, port);
+            e->naddrs = 0;
+            e->expires_ms = 0;
+        }
+        e->used_ms = now;
+        if (now >= e->expires_ms && !e->pending && pthread_create(&tid, NULL, dns_resolver, e) == 0)
+            e->pending = 1;
+        if (e->naddrs > 0 || !e->pending)
+            break;
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = deadline % 1000 * 1000000;
+        if (pthread_cond_timedwait(&dns_done, &dns_lock, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&dns_lock);
+            errno = ETIMEDOUT;
+            return 0;
+        }
+    }
+    n = e->naddrs < max ? e->naddrs : max;
+    memcpy(addrs, e->addrs, n * sizeof(ups_addr_t));
+    pthread_mutex_unlock(&dns_lock);
+    if (n == 0)
+        errno = now < e->expires_ms ? EHOSTUNREACH : EAGAIN;
+    return n;
+}
+
+/*
+ * he_connect - race connects to addrs[0..n-1], starting the next attempt
+ *    whenever the previous ones have had UPS_STAGGER_MS to finish or have
+ *    failed. The first to succeed wins and is returned still non-blocking;
+ *    -1 if none connects before the deadline
+ */
+static int he_connect(ups_addr_t *addrs, int n, long long deadline)
+{
+    struct pollfd pfd[UPS_MAX_ADDRS];
+    int npend = 0, next = 0, fd = -1, err, last_err = ETIMEDOUT, i;
+    socklen_t len;
+    long long wait;
+
+    while (next < n || npend > 0) {
+        if (next < n) {
+            ups_addr_t *a = &addrs[next++];
+            fd = socket(a->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, a->protocol);
+            if (fd < 0) {
+                last_err = errno;
+                continue;
+            }
+            if (connect(fd, (SA *)&a->sa, a->len) == 0)
+                goto won;
+            if (errno != EINPROGRESS) { /* Refused outright: try the next now */
+                last_err = errno;
+                close(fd);
+                continue;
+            }
+            pfd[npend].fd = fd;
+            pfd[npend++].events = POLLOUT;
+        }
+
+        if ((wait = deadline - dl_now()) <= 0) {
+            last_err = ETIMEDOUT;
+            break;
+        }
+        if (next < n && wait > UPS_STAGGER_MS)
+            wait = UPS_STAGGER_MS;
+        if (poll(pfd, npend, wait) < 0 && errno != EINTR) {
+            last_err = errno;
+            break;
+        }
+        for (i = 0; i < npend; i++) {
+            if (!pfd[i].revents)
+                continue;
+            len = sizeof(err);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                fd = pfd[i].fd;
+                pfd[i] = pfd[--npend];
+                goto won;
+            }
+            last_err = err;
+            close(pfd[i].fd);
+            pfd[i--] = pfd[--npend];
+        }
+    }
+    for (i = 0; i < npend; i++)
+        close(pfd[i].fd);
+    errno = last_err;
+    return -1;
+
+ won:
+    for (i = 0; i < npend; i++)
+        close(pfd[i].fd);
+    return fd;
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+    unsigned x = ((const ups_point_t *)a)->hash, y = ((const ups_point_t *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+static void build_ring(ups_group_t *g)
+{
+    char key[NI_MAXHOST + NI_MAXSERV + 16];
+    int i, v, n = 0;
+
+    g->ring = Malloc(g->nservers * UPS_VNODES * sizeof(ups_point_t));
+    for (i = 0; i < g->nservers; i++) {
+        for (v = 0; v < UPS_VNODES; v++) {
+            sprintf(key, "%s:%s#%d", g->servers[i].host, g->servers[i].port, v);
+            g->ring[n].hash = fnv1a(key);
+            g->ring[n++].server = i;
+        }
+    }
+    qsort(g->ring, n, sizeof(ups_point_t), cmp_point);
+}
+
+/*
+ * add_server - append the server named by "host:port" to g. Returns -1 if
+ *    the name is malformed, g is full or the name does not resolve
+ */
+static int add_server(ups_group_t *g, char *name)
+{
+    ups_server_t *s;
+    char *colon = strrchr(name, ':');
+
+    if (g->nservers == UPS_MAX_SERVERS || colon == NULL || colon - name >= NI_MAXHOST ||
+        strlen(colon + 1) >= NI_MAXSERV)
+        return -1;
+    s = &g->servers[g->nservers++];
+    memcpy(s->host, name, colon - name);
+    s->host[colon - name] = '\0';
+    strcpy(s->port, colon + 1);
+    if ((s->naddrs = resolve(s->host, s->port, s->addrs, UPS_MAX_ADDRS)) == 0) {
+        fprintf(stderr, "cannot resolve upstream %s\n", s->host);
+        return -1;
+    }
+    s->healthy = 1;
+    return 0;
+}
+
+static void free_table(ups_table_t *t)
+{
+    int i;
+
+    for (i = 0; i < t->ngroups; i++)
+        free(t->groups[i].ring);
+    free(t);
+}
+
+/*
+ * Servers kept across a reload start from what was known about them, so
+ * that a server that was down or ejected does not get traffic again just
+ * because the config was reloaded
+ */
+static void carry_over(ups_table_t *t, ups_table_t *old)
+{
+    ups_group_t *g, *og;
+    ups_server_t *s, *os;
+    int i, j, k, l;
+
+    for (i = 0; i < t->ngroups; i++)
+        for (g = &t->groups[i], j = 0; j < old->ngroups; j++) {
+            og = &old->groups[j];
+            if (strcasecmp(g->name, og->name))
+                continue;
+            for (k = 0; k < g->nservers; k++)
+                for (s = &g->servers[k], l = 0; l < og->nservers; l++) {
+                    os = &og->servers[l];
+                    if (strcmp(s->host, os->host) || strcmp(s->port, os->port))
+                        continue;
+                    atomic_store(&s->healthy, atomic_load(&os->healthy));
+                    atomic_store(&s->ejections, atomic_load(&os->ejections));
+                    atomic_store(&s->ejected_until, atomic_load(&os->ejected_until));
+                    atomic_store(&s->ewma_us, atomic_load(&os->ewma_us));
+                }
+        }
+}
+
+/* Read an upstream config; NULL on an error, which is reported on stderr */
+static ups_table_t *load_table(const char *config_path)
+{
+    FILE *fp;
+    char line[MAXLINE], word[NI_MAXHOST], directive[16], policy[16];
+    int lineno = 0, n;
+    ups_group_t *g = NULL;
+    ups_table_t *t;
+
+    if ((fp = fopen(config_path, "r")) == NULL) {
+        fprintf(stderr, "cannot open upstream config %s: %s\n", config_path, strerror(errno));
+        return NULL;
+    }
+    t = Calloc(1, sizeof(ups_table_t));
+    while (fgets(line, MAXLINE, fp)) {
+        lineno++;
+        if (strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        if (sscanf(line, "%15s", directive) != 1)
+            continue;
+        if (!strcmp(directive, "group")) {
+            if (t->ngroups == UPS_MAX_GROUPS)
+                goto bad;
+            g = &t->groups[t->ngroups++];
+            if (sscanf(line, "%*s %1024s %15s %1024s", g->name, policy, g->health) < 2)
+                goto bad;
+            if (!strcmp(policy, "round_robin"))
+                g->policy = UPS_ROUND_ROBIN;
+            else if (!strcmp(policy, "least_conn"))
+                g->policy = UPS_LEAST_CONN;
+            else if (!strcmp(policy, "hash"))
+                g->policy = UPS_HASH;
+            else
+                goto bad;
+        } else if (!strcmp(directive, "server")) {
+            if (!g || sscanf(line, "%*s %1024s", word) != 1 || add_server(g, word) < 0)
+                goto bad;
+        } else
+            goto bad;
+    }
+    fclose(fp);
+
+    for (n = 0; n < t->ngroups; n++) {
+        if (t->groups[n].nservers == 0) {
+            fprintf(stderr, "%s: group %s has no servers\n", config_path, t->groups[n].name);
+            t->ngroups = n;
+            free_table(t);
+            return NULL;
+        }
+        build_ring(&t->groups[n]);
+    }
+    return t;
+
+ bad:
+    fprintf(stderr, "%s:%d: bad upstream directive\n", config_path, lineno);
+    fclose(fp);
+    t->ngroups = 0;             /* No rings built yet */
+    free_table(t);
+    return NULL;
+}
+
+/* Read the upstream config and start the health checker */
+void ups_init(const char *config_path)
+{
+    ups_table_t *t;
+
+    if ((t = load_table(config_path)) == NULL)
+        exit(1);
+    atomic_store(&table, t);
+    if (t->ngroups > 0)
+        pthread_once(&checker_once, start_checker);
+}
+
+/*
+ * ups_reload - replace the upstream groups with those of the config file.
+ *    Requests in progress keep the servers they have; the old table is
+ *    freed once none of its servers is in use and UPS_GRACE_MS have passed.
+ *    Returns -1, keeping the current groups, if the file is bad
+ */
+int ups_reload(const char *config_path)
+{
+    ups_table_t *t, *old;
+
+    if ((t = load_table(config_path)) == NULL)
+        return -1;
+    if ((old = atomic_load(&table)) != NULL)
+        carry_over(t, old);
+    atomic_store(&table, t);
+    if (old) {
+        old->retired_ms = dl_now();
+        pthread_mutex_lock(&retired_lock);
+        old->next = retired;
+        retired = old;
+        pthread_mutex_unlock(&retired_lock);
+    }
+    if (t->ngroups > 0)
+        pthread_once(&checker_once, start_checker);
+    return 0;
+}
+
+/*
+ * ups_peers - form a cache cluster: 'self' is this proxy's host:port as
+ *    its peers know it, 'list' the comma-separated host:port of the
+ *    others. Every member must be given the same set of names, so that
+ *    they all build the same hash ring
+ */
+void ups_peers(const char *self, const char *list)
+{
+    char names[MAXLINE], *name, *save;
+
+    peers = Calloc(1, sizeof(ups_group_t));
+    peers->policy = UPS_HASH;
+    snprintf(names, MAXLINE, "%s,%s", self, list);
+    for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (add_server(peers, name) < 0) {
+            fprintf(stderr, "bad peer %s\n", name);
+            exit(1);
+        }
+    }
+    self_peer = 0;
+    build_ring(peers);
+    pthread_once(&checker_once, start_checker);
+}
+
+/*
+ * usable - a server takes traffic unless its last health check failed,
+ *    it is ejected, or it is much slower than the best in its group
+ */
+static int usable(ups_server_t *s, long long now, long long best_us)
+{
+    long long ewma = atomic_load(&s->ewma_us);
+
+    return atomic_load(&s->healthy) && atomic_load(&s->ejected_until) <= now &&
+        (ewma < UPS_SLOW_US || ewma <= best_us * UPS_SLOW_FACTOR);
+}
+
+/* pick - choose a server not yet in 'tried' according to the group policy */
+static int pick(ups_group_t *g, char *key, unsigned tried, int panic)
+{
+    long long now = dl_now(), best_us = -1, ewma, score, best_score = -1;
+    unsigned start = atomic_fetch_add(&g->rr, 1), h;
+    int i, j, choice = -1, lo, hi, mid;
+    ups_server_t *s;
+
+    for (i = 0; i < g->nservers; i++) {
+        ewma = atomic_load(&g->servers[i].ewma_us);
+        if (atomic_load(&g->servers[i].healthy) && (best_us < 0 || ewma < best_us))
+            best_us = ewma;
+    }
+
+    if (g->policy == UPS_HASH) {
+        /* First ring point at or after the key's hash, wrapping around */
+        h = fnv1a(key);
+        lo = 0, hi = g->nservers * UPS_VNODES;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (g->ring[mid].hash < h)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (j = 0; j < g->nservers * UPS_VNODES; j++) {
+            i = g->ring[(lo + j) % (g->nservers * UPS_VNODES)].server;
+            if (!(tried & (1u << i)) && (panic || usable(&g->servers[i], now, best_us)))
+                return i;
+        }
+        return -1;
+    }
+
+    for (j = 0; j < g->nservers; j++) {
+        i = (start + j) % g->nservers;
+        s = &g->servers[i];
+        if ((tried & (1u << i)) || !(panic || usable(s, now, best_us)))
+            continue;
+        if (g->policy == UPS_ROUND_ROBIN)
+            return i;
+        /* Least connections, weighted by latency so slow servers get fewer */
+        ewma = atomic_load(&s->ewma_us);
+        score = (atomic_load(&s->active) + 1) * (ewma > 0 ? ewma : 1);
+        if (choice < 0 || score < best_score) {
+            choice = i;
+            best_score = score;
+        }
+    }
+    return choice;
+}
+
+/*
+ * ups_connect - connect to an origin for host:port. If host names an
+ *    upstream group, a server is chosen by policy (key is hashed for
+ *    consistent hashing) and *srvp is set so the caller can report the
+ *    outcome with ups_release(); failed servers are skipped in favour of
+ *    the next choice, each getting at most UPS_CONNECT_MS. Returns the
+ *    connected, non-blocking descriptor, or -1 if the deadline passes first
+ */
+int ups_connect(char *host, char *port, char *key, long long deadline, ups_server_t **srvp)
+{
+    ups_addr_t addrs[UPS_MAX_ADDRS];
+    ups_table_t *t = atomic_load(&table);
+    ups_group_t *g = NULL;
+    ups_server_t *s;
+    unsigned tried = 0;
+    int i, n, fd;
+
+    *srvp = NULL;
+    for (i = 0; t && i < t->ngroups; i++)
+        if (!strcasecmp(t->groups[i].name, host))
+            g = &t->groups[i];
+    if (!g) {
+        if ((n = lookup(host, port, addrs, UPS_MAX_ADDRS, deadline)) == 0)
+            return -1;
+        return he_connect(addrs, n, deadline);
+    }
+
+    for (n = 0; n < g->nservers && dl_now() < deadline; n++) {
+        /* When every server looks bad, try them anyway rather than fail */
+        if ((i = pick(g, key, tried, 0)) < 0 && (i = pick(g, key, tried, 1)) < 0)
+            break;
+        tried |= 1u << i;
+        s = &g->servers[i];
+        atomic_fetch_add(&s->active, 1);
+        if ((fd = he_connect(s->addrs, s->naddrs, dl_after(UPS_CONNECT_MS, deadline))) >= 0) {
+            *srvp = s;
+            return fd;
+        }
+        ups_release(s, 0, 0);
+    }
+    return -1;
+}
+
+/*
+ * ups_peer_connect - connect to the peer that owns 'key' on the ring, for
+ *    it to serve from its cache. Ejected or unhealthy peers are passed over
+ *    to the next owner on the ring. Returns -1, meaning "fetch it yourself",
+ *    when peering is off, the owner is this proxy, or the owner cannot be
+ *    reached before the deadline (which counts against it)
+ */
+int ups_peer_connect(char *key, long long deadline, ups_server_t **srvp)
+{
+    ups_server_t *s;
+    int i, fd;
+
+    *srvp = NULL;
+    if (!peers || (i = pick(peers, key, 0, 0)) < 0 || i == self_peer)
+        return -1;
+    s = &peers->servers[i];
+    atomic_fetch_add(&s->active, 1);
+    if ((fd = he_connect(s->addrs, s->naddrs, dl_after(UPS_CONNECT_MS, deadline))) < 0) {
+        ups_release(s, 0, 0);
+        return -1;
+    }
+    *srvp = s;
+    return fd;
+}
+
+/*
+ * ups_release - report how a request to s went: 'ok' and the time to the
+ *    response headers in usec. UPS_EJECT_FAILS failures in a row eject the
+ *    server, for longer each time it happens again
+ */
+void ups_release(ups_server_t *s, int ok, long long usec)
+{
+    long long ewma;
+    int e;
+
+    if (!s)
+        return;
+    atomic_fetch_sub(&s->active, 1);
+    if (ok) {
+        ewma = atomic_load(&s->ewma_us);
+        atomic_store(&s->ewma_us, ewma ? (ewma * 7 + usec) / 8 : usec);
+        atomic_store(&s->fails, 0);
+        atomic_store(&s->ejections, 0);
+        return;
+    }
+    if (atomic_fetch_add(&s->fails, 1) + 1 == UPS_EJECT_FAILS) {
+        e = atomic_fetch_add(&s->ejections, 1);
+        atomic_store(&s->ejected_until, dl_now() + ((long long)UPS_EJECT_MS << (e < 4 ? e : 4)));
+        atomic_store(&s->fails, 0);
+    }
+}
+
+/*
+ * check_server - one active health check: connect, and if the group has a
+ *    check path, GET it and require a 2xx or 3xx status within
+ *    UPS_CHECK_TIMEOUT_MS. Feeds the latency average on success
+ */
+static void check_server(ups_group_t *g, ups_server_t *s)
+{
+    char buf[MAXLINE];
+    long long start = dl_now(), usec, ewma;
+    int fd, n = 0, r, status = 0, ok;
+
+    if ((fd = he_connect(s->addrs, s->naddrs, start + UPS_CHECK_TIMEOUT_MS)) < 0) {
+        atomic_store(&s->healthy, 0);
+        return;
+    }
+    ok = 1;
+    if (g->health[0]) {
+        snprintf(buf, MAXLINE, "GET %s HTTP/1.0\r\nHost: %s:%s\r\nConnection: close\r\n\r\n",
+                 g->health, s->host, s->port);
+        ok = dl_writen(fd, buf, strlen(buf), start + UPS_CHECK_TIMEOUT_MS) >= 0;
+        while (ok && !memchr(buf, '\n', n) && n < MAXLINE - 1) {
+            if (dl_wait(fd, POLLIN, start + UPS_CHECK_TIMEOUT_MS) < 0 ||
+                (r = read(fd, buf + n, MAXLINE - 1 - n)) <= 0)
+                ok = 0;
+            else
+                n += r;
+        }
+        buf[n] = '\0';
+        ok = ok && sscanf(buf, "HTTP/%*s %d", &status) == 1 && status >= 200 && status < 400;
+    }
+    close(fd);
+    atomic_store(&s->healthy, ok);
+    if (ok) {
+        usec = (dl_now() - start) * 1000;
+        ewma = atomic_load(&s->ewma_us);
+        atomic_store(&s->ewma_us, ewma ? (ewma * 7 + usec) / 8 : usec);
+    }
+}
+
+static void start_checker(void)
+{
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, ups_checker, NULL);
+}
+
+/* Is no server of t in use? */
+static int idle_table(ups_table_t *t)
+{
+    int i, j;
+
+    for (i = 0; i < t->ngroups; i++)
+        for (j = 0; j < t->groups[i].nservers; j++)
+            if (atomic_load(&t->groups[i].servers[j].active) > 0)
+                return 0;
+    return 1;
+}
+
+/*
+ * Free retired tables nobody can still use: none of their servers has a
+ * connection out, and they were replaced longer ago than any connect
+ * attempt (which may be between servers) can take
+ */
+static void reap_tables(void)
+{
+    ups_table_t **pp, *t;
+    long long now = dl_now();
+
+    pthread_mutex_lock(&retired_lock);
+    for (pp = &retired; (t = *pp) != NULL; ) {
+        if (t->retired_ms + UPS_GRACE_MS <= now && idle_table(t)) {
+            *pp = t->next;
+            free_table(t);
+        } else
+            pp = &t->next;
+    }
+    pthread_mutex_unlock(&retired_lock);
+}
+
+/* Health-check every server of every group, and every peer, each UPS_CHECK_MS */
+static void *ups_checker(void *vargp)
+{
+    struct timespec ts = { UPS_CHECK_MS / 1000, UPS_CHECK_MS % 1000 * 1000000L };
+    ups_table_t *t;
+    int i, j;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        t = atomic_load(&table);
+        for (i = 0; t && i < t->ngroups; i++)
+            for (j = 0; j < t->groups[i].nservers; j++)
+                check_server(&t->groups[i], &t->groups[i].servers[j]);
+        for (j = 0; peers && j < peers->nservers; j++)
+            if (j != self_peer)
+                check_server(peers, &peers->servers[j]);
+        reap_tables();
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ * upstream.h - origin selection for the proxy
+ *
+ * Requests whose host names a configured upstream group are spread over
+ * the group's servers by round-robin, least-connections or consistent
+ * hashing. A background thread health-checks every server, and servers
+ * that keep failing real requests are ejected for a while (outlier
+ * detection). All other hosts are connected to directly. Their names are
+ * resolved by helper threads into a small cache, so a request waits on a
+ * slow lookup only until its connect deadline, and not at all once the
+ * name is cached.
+ * Either way the resolved addresses are raced with a staggered
+ * non-blocking connect ("happy eyeballs"), so an unreachable address
+ * costs UPS_STAGGER_MS rather than a full connect timeout.
+ *
+ * Proxies can also pool their caches: with ups_peers(), each URI is owned
+ * by one member of a consistent-hash ring of proxies, and a proxy that
+ * does not own a URI asks the owner for it before going to the origin.
+ *
+ * Config file, one directive per line, '#' starts a comment:
+ *     group <name> round_robin|least_conn|hash [<health check path>]
+ *     server <host>:<port>
+ * A group's servers are the "server" lines that follow it. ups_reload()
+ * switches to a new version of the file without disturbing requests in
+ * progress.
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPS_MAX_GROUPS 16
+#define UPS_MAX_SERVERS 32     /* Per group */
+#define UPS_MAX_ADDRS 8        /* Addresses raced per connect */
+#define UPS_VNODES 64          /* Hash ring points per server */
+#define UPS_STAGGER_MS 250     /* Head start of each connect attempt */
+#define UPS_CONNECT_MS 1000    /* Give up on one server after this long */
+#define UPS_CHECK_MS 2000      /* Health check interval */
+#define UPS_CHECK_TIMEOUT_MS 1000
+#define UPS_EJECT_FAILS 3      /* Consecutive failures that eject a server */
+#define UPS_EJECT_MS 5000      /* First ejection; doubles on each repeat */
+#define UPS_SLOW_US 100000     /* Latency below this is never an outlier */
+#define UPS_SLOW_FACTOR 4      /* Outlier: this many times the group's best */
+#define UPS_GRACE_MS 60000     /* A replaced config is kept at least this long */
+#define UPS_DNS_ENTRIES 64     /* Origin names cached */
+#define UPS_DNS_TTL_MS 30000   /* A cached name is looked up again after this */
+#define UPS_DNS_NEG_MS 1000    /* Or after this, if it did not resolve */
+
+typedef struct ups_server ups_server_t;
+
+void ups_init(const char *config_path);
+int ups_reload(const char *config_path);
+int ups_connect(char *host, char *port, char *key, long long deadline, ups_server_t **srvp);
+void ups_peers(const char *self, const char *list);
+int ups_peer_connect(char *key, long long deadline, ups_server_t **srvp);
+void ups_release(ups_server_t *s, int ok, long long usec);
+
+#endif /* __UPSTREAM_H__ */